@@ -0,0 +1,113 @@
+#include <samd.h>
+#include "Async.h"
+#include "Deferred.h"
+
+static AsyncTask* _tasks = NULL;
+// bumped by async_wake(), only compared for a change so an increment lost to a nested interrupt doesn't matter
+static volatile uint32_t _wakeCount = 0;
+
+extern "C" {
+    static void asyncWake(void* arg) {
+        ((AsyncTask*)arg)->_wake();
+    }
+}
+
+AsyncTask::AsyncTask() {
+    timer_init(&sleepTimer, asyncWake, this);
+}
+
+void AsyncTask::start() {
+    timer_cancel(&sleepTimer);
+    _sleeping = false;
+    _timedOut = false;
+    _resume = 0;
+    _state = ASYNC_READY;
+    if (!_scheduled) {
+        _scheduled = true;
+        _next = _tasks;
+        _tasks = this;
+    }
+}
+
+void AsyncTask::stop() {
+    timer_cancel(&sleepTimer);
+    _sleeping = false;
+    _state = ASYNC_DONE;
+}
+
+bool AsyncTask::running() {
+    return _state != ASYNC_DONE;
+}
+
+// called by the sleep timer from the deferred work
+void AsyncTask::_wake() {
+    _sleeping = false;
+    _timedOut = true;
+}
+
+void AsyncTask::sleep(uint32_t ms) {
+    _sleeping = true;
+    _timedOut = false;
+    timer_start(&sleepTimer, ms, 0);
+}
+
+void AsyncTask::cancelSleep() {
+    timer_cancel(&sleepTimer);
+    _sleeping = false;
+}
+
+// Run each task once, returns true if any of them yielded and should run again before sleeping
+static bool asyncPass(bool* any_left) {
+    bool ready = false;
+    AsyncTask** link = &_tasks;
+
+    while (*link) {
+        AsyncTask* task = *link;
+        if (task->_state != ASYNC_DONE) {
+            task->_state = task->run();
+        }
+        if (task->_state == ASYNC_DONE) {
+            // unlink finished tasks, they can be started again later
+            *link = task->_next;
+            task->_scheduled = false;
+            continue;
+        }
+        if (task->_state == ASYNC_READY) {
+            ready = true;
+        }
+        link = &task->_next;
+    }
+    *any_left = (_tasks != NULL);
+    return ready;
+}
+
+void async_wake(void) {
+    _wakeCount++;
+}
+
+bool async_poll() {
+    bool any_left;
+    asyncPass(&any_left);
+    return any_left;
+}
+
+void async_run() {
+    bool any_left = (_tasks != NULL);
+
+    while (any_left) {
+        // deferred work or interrupts that run while the tasks are checked could have changed what they wait on
+        uint32_t work_runs = deferred_count();
+        uint32_t wakes = _wakeCount;
+        if (asyncPass(&any_left) || !any_left) {
+            continue;
+        }
+
+        // With interrupts disabled nothing can run between the check and the WFI,
+        // a pending interrupt still ends the WFI and runs once interrupts are enabled again.
+        __disable_irq();
+        if ((work_runs == deferred_count()) && (wakes == _wakeCount)) {
+            __WFI();
+        }
+        __enable_irq();
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include "generic.h"
+#include "Timer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// make async_run() check the tasks again before sleeping, safe to call from any interrupt
+void async_wake(void);
+#ifdef __cplusplus
+}
+
+// Cooperative tasks written as stackless coroutines.
+// A task's run() is resumed from the last point it waited at, so it can be written as straight-line
+// code with waits in it instead of a state machine. Local variables don't survive a wait, anything
+// needed afterwards must be a member of the task. Tasks are statically allocated, there is no heap.
+//
+//   class Echo : public AsyncTask {
+//       char buf[64];
+//       uint8_t run() {
+//           ASYNC_BEGIN();
+//           while (true) {
+//               ASYNC_AWAIT(usbserial.available());
+//               usbserial.write(buf, usbserial.read(buf, 64));
+//               ASYNC_SLEEP(10);
+//           }
+//           ASYNC_END();
+//       }
+//   };
+//
+// The waits are case labels in a switch, so only one can be used per line and
+// they can't be inside a switch statement of the task's own.
+
+// returned by run()
+#define ASYNC_READY   0  // yielded, run again straight away
+#define ASYNC_WAITING 1  // waiting for a condition or sleep
+#define ASYNC_DONE    2  // finished, the task is removed from the scheduler
+
+#define ASYNC_BEGIN() switch (_resume) { case 0:
+#define ASYNC_END() } _resume = 0; return ASYNC_DONE
+
+// let the other tasks run before continuing
+#define ASYNC_YIELD() do { _resume = __LINE__; return ASYNC_READY; case __LINE__:; } while (0)
+// wait until cond is true, it is checked each time the scheduler wakes
+#define ASYNC_AWAIT(cond) do { _resume = __LINE__; case __LINE__: if (!(cond)) { return ASYNC_WAITING; } } while (0)
+// sleep for ms, the core sleeps if no other task is ready
+#define ASYNC_SLEEP(ms) do { sleep(ms); ASYNC_AWAIT(!sleeping()); } while (0)
+// wait until cond is true or ms have passed, timedOut() tells which
+#define ASYNC_AWAIT_TIMEOUT(cond, ms) do { sleep(ms); ASYNC_AWAIT((cond) || !sleeping()); cancelSleep(); } while (0)
+
+class AsyncTask {
+public:
+    AsyncTask();
+
+    // add the task to the scheduler, running it from the beginning
+    void start();
+    // stop the task, it is removed from the scheduler on its next pass
+    void stop();
+    bool running();
+
+    // the body of the task, between ASYNC_BEGIN() and ASYNC_END()
+    virtual uint8_t run() {return ASYNC_DONE;}
+
+    // used by the scheduler
+    AsyncTask* _next = NULL;
+    bool _scheduled = false;
+    uint8_t _state = ASYNC_DONE;
+    void _wake();
+
+protected:
+    uint16_t _resume = 0;  // line of the wait to resume from, 0 at the start
+
+    void sleep(uint32_t ms);
+    void cancelSleep();
+    bool sleeping() {return _sleeping;}
+    // whether the last ASYNC_AWAIT_TIMEOUT timed out
+    bool timedOut() {return _timedOut;}
+
+private:
+    soft_timer_t sleepTimer;
+    volatile bool _sleeping = false;
+    bool _timedOut = false;
+};
+
+// Run the started tasks until they have all finished.
+// When every task is waiting the core sleeps until an interrupt, so conditions should be
+// changed by interrupts or deferred work (USB transfers, timers) rather than by polling hardware.
+// Deferred work that runs while the tasks are checked is seen, an interrupt handler that changes
+// a condition itself must call async_wake() afterwards or the change can wait for the next interrupt.
+void async_run();
+// run each task once, returns false once no tasks are left
+bool async_poll();
+#endif
@@ -0,0 +1,91 @@
+#include <samd.h>
+#include "generic.h"
+#include "Clock.h"
+
+#define CLOCK_GENERATOR_MAIN 0
+
+typedef struct {
+    uint32_t hz;
+    uint32_t source;
+    uint8_t wait_states;  // flash wait states needed at this frequency, cf table 37-42 of the datasheet
+} clock_profile_t;
+
+static const clock_profile_t _profiles[] = {
+    {48000000ul, GCLK_GENCTRL_SRC_DFLL48M, 1},
+    {8000000ul,  GCLK_GENCTRL_SRC_OSC8M,   0},
+#if defined(CRYSTALLESS)
+    {32768ul,    GCLK_GENCTRL_SRC_OSC32K,  0},
+#else
+    {32768ul,    GCLK_GENCTRL_SRC_XOSC32K, 0},
+#endif
+};
+
+static uint8_t _profile = CLOCK_PROFILE_PERFORMANCE;
+static clock_listener_t* _listeners = NULL;
+
+bool clock_set_profile(uint8_t profile) {
+    if (profile > CLOCK_PROFILE_IDLE) {
+        return false;
+    }
+#ifndef TICKLESS_IDLE
+    if (profile == CLOCK_PROFILE_IDLE) {
+        return false;
+    }
+#endif
+    if ((profile == CLOCK_PROFILE_IDLE) && !clockLocked()) {
+        // the 32kHz crystal is still starting
+        return false;
+    }
+    if (profile == _profile) {
+        return true;
+    }
+    const clock_profile_t* next = &_profiles[profile];
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    // more wait states before speeding up, fewer only once slowed down
+    if (next->wait_states > NVMCTRL->CTRLB.bit.RWS) {
+        NVMCTRL->CTRLB.bit.RWS = next->wait_states;
+    }
+
+    // the ms tick continues at the new rate from the next ms
+    prepareTickClock(next->hz);
+    GCLK->GENCTRL.reg = GCLK_GENCTRL_ID(CLOCK_GENERATOR_MAIN) |
+                        next->source |
+                        GCLK_GENCTRL_IDC |
+                        GCLK_GENCTRL_GENEN;
+    while (GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY);
+
+    if (next->wait_states < NVMCTRL->CTRLB.bit.RWS) {
+        NVMCTRL->CTRLB.bit.RWS = next->wait_states;
+    }
+    SystemCoreClock = next->hz;
+    _profile = profile;
+
+    if (!primask) {
+        __enable_irq();
+    }
+
+    for (clock_listener_t* listener = _listeners; listener; listener = listener->next) {
+        listener->changed(next->hz, listener->arg);
+    }
+    return true;
+}
+
+uint8_t clock_get_profile(void) {
+    return _profile;
+}
+
+void clock_add_listener(clock_listener_t* listener, clock_changed_t changed, void* arg) {
+    listener->changed = changed;
+    listener->arg = arg;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    listener->next = _listeners;
+    _listeners = listener;
+    if (!primask) {
+        __enable_irq();
+    }
+}
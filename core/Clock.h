@@ -0,0 +1,42 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Runtime core clock profiles, switching Generic Clock Generator 0 between sources.
+// USB has its own 48MHz generator from the DFLL so keeps running in every profile,
+// though at 32kHz its interrupts are handled slowly so IDLE is best kept to when the port is quiet.
+// Peripherals on Generic Clock Generator 3 (OSC8M) or 1 (32kHz) aren't affected,
+// anything clocked from Generator 0 or the APB bus should register a listener to recalculate its baud/prescaler.
+
+#define CLOCK_PROFILE_PERFORMANCE 0  // 48MHz from the DFLL
+#define CLOCK_PROFILE_BALANCED    1  // 8MHz from OSC8M
+#define CLOCK_PROFILE_IDLE        2  // 32.768kHz from the 32kHz oscillator, only with TICKLESS_IDLE
+
+typedef void (*clock_changed_t)(uint32_t hz, void* arg);
+
+typedef struct clock_listener {
+    struct clock_listener* next;
+    clock_changed_t changed;
+    void* arg;
+} clock_listener_t;
+
+// Switch the core clock, flash wait states and ms tick, then call the listeners with the new frequency.
+// Returns false if the profile isn't available: IDLE needs TICKLESS_IDLE, since a 32 cycle SysTick
+// period would leave no time to run. FAST_BOOT isn't needed and can't be used with TICKLESS_IDLE,
+// so in builds with IDLE the 32kHz oscillator is always running before main().
+// Without TICKLESS_IDLE this waits up to 1ms with interrupts disabled, so the switch lines up with
+// the start of a ms and no time is lost.
+bool clock_set_profile(uint8_t profile);
+uint8_t clock_get_profile(void);
+
+// changed is called from clock_set_profile after each switch, a listener must only be added once
+void clock_add_listener(clock_listener_t* listener, clock_changed_t changed, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
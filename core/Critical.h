@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <samd.h>
+#include "Deferred.h"
+
+// Scoped critical sections, the section lasts until the object goes out of scope.
+// Each one saves the state it changes in itself and restores only that,
+// so they nest and can be used from any context.
+//
+//   {
+//       IrqMaskSection section(IRQ_LINE(USB_IRQn));
+//       ... data shared with the USB interrupt ...
+//   }
+
+#define IRQ_LINE(irqn) (1UL << (irqn))
+
+// Masks every interrupt with PRIMASK
+class CriticalSection {
+public:
+    inline CriticalSection() : primask(__get_PRIMASK()) {__disable_irq();}
+    inline ~CriticalSection() {if(!primask){__enable_irq();}}
+
+private:
+    uint32_t primask;
+
+    CriticalSection(const CriticalSection&);
+    CriticalSection& operator=(const CriticalSection&);
+};
+
+// A CriticalSection only when enabled, for code that is sometimes lock-free
+template <bool enabled> class CriticalSectionIf : public CriticalSection {};
+// the constructor keeps -Wunused-variable quiet where the section is only a scope
+template <> class CriticalSectionIf<false> {
+public:
+    inline CriticalSectionIf() {}
+};
+
+// Masks only the NVIC lines in mask, built from IRQ_LINE(), for data that is only shared with those
+// interrupts. Other interrupts keep their usual latency.
+// Lines that were already disabled are left disabled, so a nested section doesn't enable them early.
+// The lines must not be enabled or disabled elsewhere while the section is held.
+class IrqMaskSection {
+public:
+    inline IrqMaskSection(uint32_t mask) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        lines = NVIC->ISER[0] & mask;
+        NVIC->ICER[0] = lines;
+        if (!primask) {
+            __enable_irq();
+        }
+        // make sure the masked interrupts can't be taken after the section starts
+        __DSB();
+        __ISB();
+    }
+    inline ~IrqMaskSection() {NVIC->ISER[0] = lines;}
+
+private:
+    uint32_t lines;
+
+    IrqMaskSection(const IrqMaskSection&);
+    IrqMaskSection& operator=(const IrqMaskSection&);
+};
+
+// Holds off deferred work, for data shared with the PendSV bottom halves (USB transfers, timers).
+// PendSV is a system exception so can't be masked in the NVIC, queued work runs when the last section ends.
+// Every interrupt above PendSV keeps running.
+class DeferredSection {
+public:
+    inline DeferredSection() {deferred_lock();}
+    inline ~DeferredSection() {deferred_unlock();}
+
+private:
+    DeferredSection(const DeferredSection&);
+    DeferredSection& operator=(const DeferredSection&);
+};
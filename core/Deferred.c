@@ -0,0 +1,117 @@
+#include <samd.h>
+#include "generic.h"
+#include "Deferred.h"
+
+static deferred_work_t* _workHead = NULL;
+static deferred_work_t* _workTail = NULL;
+#ifdef DEFERRED_STATS
+static deferred_stats_t _workStats = {0, 0, 0};
+#endif
+static volatile uint32_t _workCount = 0;
+// Locks always nest, so an interrupt between the load and store of the count leaves it as it found it
+static volatile uint8_t _workLocks = 0;
+static volatile bool _workHeld = false;  // PendSV ran while locked
+
+void deferred_init(deferred_work_t* work, deferred_fn_t fn, void* arg) {
+    work->next = NULL;
+    work->fn = fn;
+    work->arg = arg;
+    work->queued = 0;
+#ifdef DEFERRED_STATS
+    work->posted = 0;
+#endif
+}
+
+HOT_RAMFUNC
+void deferred_post(deferred_work_t* work) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if (!work->queued) {
+        work->queued = 1;
+#ifdef DEFERRED_STATS
+        work->posted = (uint32_t)cycles64();
+#endif
+        work->next = NULL;
+        if (_workTail) {
+            _workTail->next = work;
+        } else {
+            _workHead = work;
+        }
+        _workTail = work;
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+    }
+
+    if (!primask) {
+        __enable_irq();
+    }
+}
+
+HOT_RAMFUNC
+void deferred_run(void) {
+    if (_workLocks) {
+        // the unlock pends PendSV again
+        _workHeld = true;
+        return;
+    }
+    while (true) {
+        __disable_irq();
+        deferred_work_t* work = _workHead;
+        if (!work) {
+            __enable_irq();
+            return;
+        }
+        _workHead = work->next;
+        if (!_workHead) {
+            _workTail = NULL;
+        }
+        // the work can be posted again while it runs
+        work->queued = 0;
+
+        _workCount++;
+#ifdef DEFERRED_STATS
+        uint32_t latency = (uint32_t)cycles64() - work->posted;
+        _workStats.runs++;
+        _workStats.last_latency = latency;
+        if (latency > _workStats.max_latency) {
+            _workStats.max_latency = latency;
+        }
+#endif
+        __enable_irq();
+
+        work->fn(work->arg);
+    }
+}
+
+void deferred_lock(void) {
+    _workLocks++;
+}
+
+void deferred_unlock(void) {
+    if (!(--_workLocks) && _workHeld) {
+        _workHeld = false;
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+    }
+}
+
+uint32_t deferred_count(void) {
+    return _workCount;
+}
+
+#ifdef DEFERRED_STATS
+void deferred_get_stats(deferred_stats_t* stats, bool reset) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    *stats = _workStats;
+    if (reset) {
+        _workStats.runs = 0;
+        _workStats.max_latency = 0;
+        _workStats.last_latency = 0;
+    }
+
+    if (!primask) {
+        __enable_irq();
+    }
+}
+#endif
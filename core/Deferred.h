@@ -0,0 +1,63 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deferred work, run from PendSV at the lowest interrupt priority.
+// Interrupts post work items and return, the work then runs once no other interrupt is active.
+// Work items run in the order they were posted and don't pre-empt each other.
+// Built with DEFERRED_STATS each item is stamped when posted to measure the queueing latency,
+// otherwise posting is kept to the queue itself.
+
+typedef void (*deferred_fn_t)(void* arg);
+
+typedef struct deferred_work {
+    struct deferred_work* next;
+    deferred_fn_t fn;
+    void* arg;
+    volatile uint8_t queued;
+#ifdef DEFERRED_STATS
+    uint32_t posted;  // cycle count when posted, to measure the queueing latency
+#endif
+} deferred_work_t;
+
+#ifdef DEFERRED_STATS
+#define DEFERRED_WORK_INIT(fn, arg) {NULL, (fn), (arg), 0, 0}
+#else
+#define DEFERRED_WORK_INIT(fn, arg) {NULL, (fn), (arg), 0}
+#endif
+
+#ifdef DEFERRED_STATS
+typedef struct {
+    uint32_t runs;         // work items run
+    uint32_t max_latency;  // most cycles between posting and running an item
+    uint32_t last_latency;
+} deferred_stats_t;
+#endif
+
+void deferred_init(deferred_work_t* work, deferred_fn_t fn, void* arg);
+// queue work to run, does nothing if it is already queued. Can be called from any context.
+void deferred_post(deferred_work_t* work);
+// run all queued work, called from PendSV
+void deferred_run(void);
+
+// Hold off running work until the matching unlock, calls nest.
+// Work posted in between stays queued and runs once the last lock is released.
+void deferred_lock(void);
+void deferred_unlock(void);
+
+// number of work items run since startup, a change shows work ran between two points
+uint32_t deferred_count(void);
+
+#ifdef DEFERRED_STATS
+// copy the latency stats, reset clears them after copying
+void deferred_get_stats(deferred_stats_t* stats, bool reset);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <stdint.h>
+#include "RingBuffer.h"
+
+
+#ifdef __cplusplus
+
+// Receive buffer for USB OUT transfers made up of whole packet slots.
+// Every slot is 4-byte aligned and a full packet long, so the endpoint is always given a complete
+// packet to write into no matter how much data the previous transfer contained.
+// The consumer side matches RingBuffer, the producer side is only the DMA helpers.
+// It is always lock-free, the USB interrupt must be the only producer and the main loop the only consumer.
+template <uint16_t N, uint8_t P=64> class PacketRingBuffer {
+public:
+    // type used for lengths and sizes, uint8_t for buffers up to 255 bytes and uint16_t above that
+    typedef typename RingBufferLength<(N <= 0xFF)>::type len_t;
+
+protected:
+    static const uint8_t slots = N / P;
+    static_assert((N % P) == 0 && (P % 4) == 0, "PacketRingBuffer must hold whole, word-sized packets");
+    static_assert(slots >= 1 && slots < 128, "PacketRingBuffer must have between 1 and 127 slots");
+
+    // Alignment required for DMA from USB
+    __attribute__((__aligned__(4))) uint8_t _buffer[slots][P];
+    uint8_t _length[slots];  // bytes received into each slot, only written by the producer
+    // slot indices run over twice the number of slots so a full buffer can be told apart from an empty one
+    volatile uint8_t headIdx;  // index of the next slot to receive into
+    volatile uint8_t tailIdx;  // index of the slot currently being read
+    uint8_t tailOffset;        // bytes already read from the tail slot
+    uint8_t armedIdx;          // index of the next slot to give to the DMA, ahead of the head while transfers are in flight
+
+    inline uint8_t slot(uint8_t idx) {return (idx >= slots) ? (idx - slots) : idx;}
+    inline uint8_t step(uint8_t idx) {return ((idx + 1) >= (2 * slots)) ? 0 : (idx + 1);}
+    inline uint8_t usedSlots(uint8_t head, uint8_t tail) {return (head >= tail) ? (head - tail) : (head + (2 * slots) - tail);}
+    // frees any empty packets at the tail so the tail slot always has data to read when the buffer isn't empty
+    void dropEmptySlots();
+
+public:
+    PacketRingBuffer();
+
+    // consumer methods
+    uint8_t read_char();
+    len_t read(uint8_t* buffer, len_t max_len);
+    // discards the unread data
+    void clear();
+
+    len_t usedSpace();
+    len_t availableSpace();
+    bool isFull();
+    bool isEmpty();
+
+    /// Zero-copy access, see RingBuffer::peek.
+    /// Slots aren't contiguous so the regions only cover the next two packets, not all the data.
+    len_t peek(RingBufferSpan regions[2]);
+    void consume(len_t len);
+
+    /// Helper methods for using the buffer with DMA
+    // returns pointer to an empty slot, len is always a full packet.
+    // Can be called again before completing to queue another transfer,
+    // completions must then be in the same order.
+    uint8_t* prepareDirectWrite(len_t* len);
+    // len bytes were received into the oldest slot from prepareDirectWrite
+    void completeDirectWrite(len_t len);
+};
+
+
+template <uint16_t N, uint8_t P> PacketRingBuffer<N,P>::PacketRingBuffer() {
+    headIdx = 0;
+    tailIdx = 0;
+    tailOffset = 0;
+    armedIdx = 0;
+}
+
+template <uint16_t N, uint8_t P> void PacketRingBuffer<N,P>::dropEmptySlots() {
+    uint8_t tail = tailIdx;
+    uint8_t head = headIdx;
+    __DMB();
+
+    if ((tail == head) || _length[slot(tail)]) {
+        return;
+    }
+    while ((tail != head) && !_length[slot(tail)]) {
+        tail = step(tail);
+    }
+    tailOffset = 0;
+    tailIdx = tail;
+}
+
+template <uint16_t N, uint8_t P> uint8_t PacketRingBuffer<N,P>::read_char() {
+    if (isEmpty()) {
+        /// TODO: what should we return when there isn't anything
+        return 0;
+    }
+    __DMB();
+
+    uint8_t c = _buffer[slot(tailIdx)][tailOffset];
+    consume(1);
+    return c;
+}
+template <uint16_t N, uint8_t P> typename PacketRingBuffer<N,P>::len_t PacketRingBuffer<N,P>::read(uint8_t* buffer, len_t max_len) {
+    len_t total_transfered = 0;
+
+    uint8_t tail = tailIdx;
+    uint8_t head = headIdx;
+    uint8_t offset = tailOffset;
+    __DMB();
+
+    // copy from each received packet in turn
+    while ((total_transfered < max_len) && (tail != head)) {
+        len_t len = min(max_len - total_transfered, _length[slot(tail)] - offset);
+        ringbuffer_copy(buffer + total_transfered, _buffer[slot(tail)] + offset, len);
+        total_transfered += len;
+
+        tail = step(tail);
+        offset = 0;
+    }
+
+    consume(total_transfered);
+    return total_transfered;
+}
+
+template <uint16_t N, uint8_t P> void PacketRingBuffer<N,P>::clear() {
+    tailOffset = 0;
+    tailIdx = headIdx;
+}
+
+template <uint16_t N, uint8_t P> typename PacketRingBuffer<N,P>::len_t PacketRingBuffer<N,P>::usedSpace() {
+    uint8_t head = headIdx;
+    len_t used_len = 0;
+
+    for (uint8_t idx = tailIdx; idx != head; idx = step(idx)) {
+        used_len += _length[slot(idx)];
+    }
+    return (used_len - tailOffset);
+}
+template <uint16_t N, uint8_t P> typename PacketRingBuffer<N,P>::len_t PacketRingBuffer<N,P>::availableSpace() {
+    // partially received slots can't be refilled, so only count empty slots
+    return ((slots - usedSlots(headIdx, tailIdx)) * P);
+}
+
+template <uint16_t N, uint8_t P> bool PacketRingBuffer<N,P>::isFull() {
+    return (usedSlots(headIdx, tailIdx) >= slots);
+}
+template <uint16_t N, uint8_t P> bool PacketRingBuffer<N,P>::isEmpty() {
+    dropEmptySlots();
+    return (headIdx == tailIdx);
+}
+
+template <uint16_t N, uint8_t P> typename PacketRingBuffer<N,P>::len_t PacketRingBuffer<N,P>::peek(RingBufferSpan regions[2]) {
+    dropEmptySlots();
+    uint8_t tail = tailIdx;
+    uint8_t head = headIdx;
+    uint8_t offset = tailOffset;
+    __DMB();
+
+    len_t total_len = 0;
+    for (uint8_t i = 0; i < 2; i++) {
+        regions[i].data = _buffer[slot(tail)] + offset;
+        regions[i].len = 0;
+        if (tail != head) {
+            regions[i].len = _length[slot(tail)] - offset;
+            tail = step(tail);
+            offset = 0;
+        }
+        total_len += regions[i].len;
+    }
+
+    return total_len;
+}
+template <uint16_t N, uint8_t P> void PacketRingBuffer<N,P>::consume(len_t len) {
+    uint8_t tail = tailIdx;
+    uint8_t head = headIdx;
+
+    // step through the packets until len is used up, a slot is freed once all its data is read
+    while (len && (tail != head)) {
+        uint8_t remaining = _length[slot(tail)] - tailOffset;
+        if (len < remaining) {
+            tailOffset += len;
+            break;
+        }
+        len -= remaining;
+        tailOffset = 0;
+        tail = step(tail);
+    }
+
+    __DMB();
+    tailIdx = tail;
+}
+
+// these functions are not protected against interrupts since they should only be used by a single interrupt
+template <uint16_t N, uint8_t P> HOT_INLINE uint8_t* PacketRingBuffer<N,P>::prepareDirectWrite(len_t* len) {
+    uint8_t armed = armedIdx;
+    // slots already given to the DMA count as used
+    if (usedSlots(armed, tailIdx) >= slots) {
+        *len = 0;
+        return NULL;
+    }
+
+    armedIdx = step(armed);
+    *len = P;
+    return _buffer[slot(armed)];
+}
+template <uint16_t N, uint8_t P> HOT_INLINE void PacketRingBuffer<N,P>::completeDirectWrite(len_t len) {
+    uint8_t head = headIdx;
+    if (!len && (step(head) == armedIdx)) {
+        // nothing else is in flight so the empty slot can just be given to the DMA again
+        armedIdx = head;
+        return;
+    }
+    // otherwise later slots are already armed, an empty packet still has to be published
+    // to keep the slots in order and is dropped by the consumer
+    _length[slot(head)] = len;
+
+    __DMB();
+    headIdx = step(head);
+}
+
+#endif
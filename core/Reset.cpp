@@ -17,7 +17,9 @@
 */
 
 #include <samd.h>
+#include "generic.h"
 #include "Reset.h"
+#include "Timer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -26,14 +28,15 @@ extern "C" {
 #define NVM_MEMORY ((volatile uint16_t *)0x000000)
 
 extern const uint32_t __text_start__;
-#define APP_START ((volatile uint32_t)(&__text_start__) + 4)
+#define APP_START ((volatile uintptr_t)(&__text_start__) + 4)
 // #define APP_START 0x00002004
 
 static inline bool nvmReady(void) {
   return NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY;
 }
 
-__attribute__ ((long_call, section (".ramfunc")))
+// runs from RAM as it erases flash
+RAMFUNC
 static void banzai() {
   // Disable all interrupts
   __disable_irq();
@@ -61,23 +64,23 @@ reset:
   while (true);
 }
 
-static int ticks = -1;
+static void resetTimeout(void* arg) {
+  (void)arg;
+  banzai();
+}
+
+static soft_timer_t resetTimer;
 
-void initiateReset(int _ticks) {
+void initiateReset(int ms) {
   resetExternalChip();
-  ticks = _ticks;
+  if (!resetTimer.callback) {
+    timer_init(&resetTimer, resetTimeout, NULL);
+  }
+  timer_start(&resetTimer, ms, 0);
 }
 
 void cancelReset() {
-  ticks = -1;
-}
-
-void tickReset() {
-  if (ticks == -1)
-    return;
-  ticks--;
-  if (ticks == 0)
-    banzai();
+  timer_cancel(&resetTimer);
 }
 
 #ifdef __cplusplus
@@ -23,7 +23,6 @@ extern "C" {
 #endif
 
 void initiateReset(int ms);
-void tickReset();
 void cancelReset();
 
  __attribute__ ((weak)) void resetExternalChip() {};
@@ -0,0 +1,52 @@
+#include "RingBuffer.h"
+
+HOT_RAMFUNC void ringbuffer_copy(uint8_t* dst, const uint8_t* src, uint16_t len) {
+    if (len >= 8) {
+        // copy the head byte-wise until the destination is aligned
+        while (reinterpret_cast<uintptr_t>(dst) & 0x3) {
+            *dst++ = *src++;
+            len--;
+        }
+
+        ringbuffer_word_t* dst_word = reinterpret_cast<ringbuffer_word_t*>(dst);
+        uint8_t src_offset = reinterpret_cast<uintptr_t>(src) & 0x3;
+        uint16_t word_len = len & ~0x3;
+
+        if (!src_offset) {
+            const ringbuffer_word_t* src_word = reinterpret_cast<const ringbuffer_word_t*>(src);
+#ifdef __arm__
+            for (; len >= 16; len -= 16) {
+                __asm__ __volatile__ (
+                    "ldmia %[src]!, {r3, r4, r5, r6}\n\t"
+                    "stmia %[dst]!, {r3, r4, r5, r6}\n\t"
+                    : [src] "+l" (src_word), [dst] "+l" (dst_word)
+                    :
+                    : "r3", "r4", "r5", "r6", "memory"
+                );
+            }
+#endif
+            for (; len >= 4; len -= 4) {
+                *dst_word++ = *src_word++;
+            }
+        } else {
+            // read whole words from the aligned address below the source and merge adjacent pairs,
+            // every word read contains at least one byte of the source so this can't fault
+            const ringbuffer_word_t* src_word = reinterpret_cast<const ringbuffer_word_t*>(src - src_offset);
+            uint8_t shift = src_offset * 8;
+            uint32_t current = *src_word++;
+            for (; len >= 4; len -= 4) {
+                uint32_t next = *src_word++;
+                *dst_word++ = (current >> shift) | (next << (32 - shift));  // little-endian
+                current = next;
+            }
+        }
+
+        dst = reinterpret_cast<uint8_t*>(dst_word);
+        src += word_len;
+    }
+
+    // copy the tail byte-wise
+    while (len--) {
+        *dst++ = *src++;
+    }
+}
@@ -2,151 +2,227 @@
 
 #include <stdint.h>
 #include "generic.h"
-#include <string.h>  // Required for memcpy
+#include "Critical.h"
+#include <string.h>
 
 
 #ifdef __cplusplus
 
 #define BUFFER_USB_RX_ALIGN 0x1
 #define BUFFER_USB_TX_ALIGN 0x2
+// Single producer/single consumer mode, e.g. the main loop on one side and an ISR on the other.
+// The head is only written by the producer and the tail only by the consumer so no method
+// masks interrupts, but each method must only be called from the side that owns it.
+#define BUFFER_LOCK_FREE    0x4
+
+// Copy used for all transfers in and out of the buffers.
+// newlib-nano's memcpy is byte-oriented on the M0+ and the spans here are short and often unaligned,
+// so once the destination is word aligned the bulk is moved a word at a time.
+// When the source shares the alignment 16 bytes are moved per LDM/STM pair,
+// otherwise aligned source words are shifted into place. Any tail is copied byte-wise.
+// Defined in RingBuffer.cpp so all buffer instantiations share one copy, which runs from RAM with the other hot paths.
+// The buffers are bytes, word accesses go through may_alias types so they can't be reordered against them.
+typedef uint32_t __attribute__((__may_alias__)) ringbuffer_word_t;
+void ringbuffer_copy(uint8_t* dst, const uint8_t* src, uint16_t len);
+
+// a contiguous region of a ring buffer
+struct RingBufferSpan {
+    uint8_t* data;
+    uint16_t len;
+};
+
+// smallest unsigned type that can hold the length of a buffer
+template <bool fits_uint8> struct RingBufferLength {typedef uint16_t type;};
+template <> struct RingBufferLength<true> {typedef uint8_t type;};
+
+template <uint16_t N, uint8_t flags=0> class RingBuffer {
+public:
+    // type used for lengths and sizes, uint8_t for buffers up to 255 bytes and uint16_t above that
+    typedef typename RingBufferLength<(N <= 0xFF)>::type len_t;
 
-template <uint8_t N, uint8_t align=0> class RingBuffer {
 protected:
+    // Power of two sizes use free-running indices that are only masked when accessing the buffer.
+    // This makes the length calculations branch-free and lets every slot be used.
+    static const bool pow2 = ((N & (N - 1)) == 0);
+    // for other sizes the indices are adjacent at full so 1 slot is always unusable
+    static const len_t capacity = (pow2 ? N : N - 1);
+
     // Alignment required for DMA from USB
     __attribute__((__aligned__(4))) uint8_t _buffer[N];
     // if rx alignment is needed add secondary aligned buffer for DMA to write to, set to size=1 otherwise
-    __attribute__((__aligned__(4))) uint8_t _rx_buffer[((align & BUFFER_USB_RX_ALIGN)?8:1)];
-    uint8_t* volatile headPtr;  // points to the next slot to write data to
-    uint8_t* volatile tailPtr;  // points to the next slot to read data from
-    uint8_t* volatile endPtr;   // points to the element beyond the end of the buffer
-
-    inline void wrap_headPtr();
-    inline void wrap_tailPtr();
-
-    uint8_t __irq_status = 0;
-    inline void pauseInterrupts() {__irq_status=__get_PRIMASK(); __disable_irq();}
-    inline void resumeInterrupts() {if(!__irq_status){__enable_irq();}}
+    __attribute__((__aligned__(4))) uint8_t _rx_buffer[((flags & BUFFER_USB_RX_ALIGN)?8:1)];
+    // in lock-free mode the consumer can't pad the head to keep the tail aligned,
+    // so unaligned data is sent from an aligned copy instead, set to size=1 otherwise
+    __attribute__((__aligned__(4))) uint8_t _tx_buffer[(((flags & BUFFER_USB_TX_ALIGN) && (flags & BUFFER_LOCK_FREE))?8:1)];
+    volatile len_t headIdx;  // index of the next slot to write data to
+    volatile len_t tailIdx;  // index of the next slot to read data from
+    len_t sendIdx;           // index of the next slot to give to the DMA, ahead of the tail while transfers are in flight
+    len_t dropLen;           // data cleared behind transfers in flight, skipped once the last of them completes
+
+    // position in the buffer of an index
+    inline len_t offset(len_t idx) {return (pow2 ? (idx & (N - 1)) : idx);}
+    // move an index forward by len, wrapping at the end of the buffer
+    inline len_t step(len_t idx, len_t len);
+    inline len_t usedSpace(len_t head, len_t tail);
+    // publish a new tail, sendIdx follows it while no direct read is in flight so clear() can tell when one is
+    inline void setTail(len_t tail);
+
+    // masks interrupts until the end of the method unless the buffer is lock-free
+    typedef CriticalSectionIf<!(flags & BUFFER_LOCK_FREE)> section_t;
+    // orders the buffer contents against the head/tail, only needed when there's no critical section
+    inline void memoryBarrier() {if(flags & BUFFER_LOCK_FREE){__DMB();}}
 
 public:
     RingBuffer();
 
-    uint8_t store(const char* buffer, uint8_t len);
+    // producer methods
+    len_t store(const char* buffer, len_t len);
     uint8_t store(const uint8_t c);
+    // consumer methods
     uint8_t read_char();
-    uint8_t read(uint8_t* buffer, uint8_t max_len);
+    len_t read(uint8_t* buffer, len_t max_len);
+    // in lock-free mode this discards the unread data and must only be called by the consumer.
+    // Data already given to the DMA is left for its completion to release.
     void clear();
 
-    uint8_t usedSpace();
-    uint8_t availableSpace();
+    len_t usedSpace();
+    // data not yet given to the DMA, usedSpace() also counts transfers in flight
+    len_t unsentSpace();
+    len_t availableSpace();
     bool isFull();
     bool isEmpty();
 
+    /// Zero-copy access, the data is split into a second region when it wraps past the end of the buffer.
+    /// The regions stay valid until they are released and only one side may use them.
+    // consumer: fills regions with the readable data and returns the total length
+    len_t peek(RingBufferSpan regions[2]);
+    // consumer: release len bytes from the start of the peeked data
+    void consume(len_t len);
+    // producer: fills regions with the writeable space and returns the total length,
+    // not available with BUFFER_USB_TX_ALIGN in locked mode since the consumer moves the head
+    len_t reserve(RingBufferSpan regions[2]);
+    // producer: publish len bytes written to the start of the reserved space
+    void commit(len_t len);
+
     /// Helper methods for using the buffer with DMA,
-    /// only valid if all data in the same direction uses DMA
+    /// only valid if all data in the same direction uses DMA.
+    /// Always inlined, so they run from RAM in the USB callbacks
     // returns pointer to the start of the writeable sub-buffer
-    uint8_t* prepareDirectWrite(uint8_t* len);
-    // returns pointer to the start of the readable sub-buffer
-    uint8_t* prepareDirectRead(uint8_t* len);
-
-    void completeDirectWrite(uint8_t len);
-    void completeDirectRead(uint8_t len);
+    uint8_t* prepareDirectWrite(len_t* len);
+    // returns pointer to the start of the readable sub-buffer, at most limit bytes long.
+    // Can be called again before completing to queue another transfer after the first,
+    // completions must then be in the same order.
+    // With BUFFER_USB_TX_ALIGN in locked mode a limit below 4 only sends the last bytes queued.
+    uint8_t* prepareDirectRead(len_t* len, len_t limit=N);
+    // copies up to limit bytes of the next data into buffer as one transfer, for data that isn't
+    // contiguous or aligned in the buffer. Returns the length, completed with completeDirectRead
+    // in order with the direct transfers.
+    len_t prepareCopyRead(uint8_t* buffer, len_t limit);
+
+    void completeDirectWrite(len_t len);
+    void completeDirectRead(len_t len);
 };
 
 
-template <uint8_t N, uint8_t align> RingBuffer<N,align>::RingBuffer() {
-    // endPtr points to the element beyond the end of the buffer
-    endPtr = _buffer + N;
-    clear();
+template <uint16_t N, uint8_t flags> RingBuffer<N,flags>::RingBuffer() {
+    headIdx = 0;
+    tailIdx = 0;
+    sendIdx = 0;
+    dropLen = 0;
 }
 
-template <uint8_t N, uint8_t align> inline void RingBuffer<N,align>::wrap_headPtr() {
-    if (headPtr >= endPtr) {
-        // head moved off the end of the buffer, reset it to the beginning
-        headPtr = _buffer;
-    }
-}
-template <uint8_t N, uint8_t align> inline void RingBuffer<N,align>::wrap_tailPtr() {
-    if (tailPtr >= endPtr) {
-        // tail moved off the end of the buffer, reset it to the beginning
-        tailPtr = _buffer;
+template <uint16_t N, uint8_t flags> inline typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::step(len_t idx, len_t len) {
+    if (pow2) {
+        // wraps with the index type, the mask is applied on access
+        return (len_t)(idx + len);
     }
+    // index moved off the end of the buffer, continue from the beginning
+    return ((idx + len) >= N) ? (idx + len - N) : (idx + len);
 }
 
-template <uint8_t N, uint8_t align> uint8_t RingBuffer<N,align>::store(const char* buffer, uint8_t len) {
-    uint8_t total_transfered = 0;
+template <uint16_t N, uint8_t flags> typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::store(const char* buffer, len_t len) {
+    len_t total_transfered = 0;
 
-    pauseInterrupts();
+    section_t section;
+    // work on a local copy of the head so it is only published once the data is in place
+    len_t head = headIdx;
     // create a copy of the buffer pointer since the local copy is not constant but the data pointed at is
     uint8_t* bufferPtr = (uint8_t*)buffer;
     // calculate max length from requested and space available
-    uint8_t max_len = min(len, availableSpace());
+    len_t max_len = min(len, capacity - usedSpace(head, tailIdx));
+    memoryBarrier();
 
-    // handle splitting on end pointer
-    if ((headPtr + max_len) >= endPtr) {
-        uint8_t prewrap_len = (endPtr - 1) - headPtr;
-        memcpy(headPtr, bufferPtr, prewrap_len);
+    // handle splitting at the end of the buffer
+    len_t prewrap_len = N - offset(head);
+    if (max_len > prewrap_len) {
+        ringbuffer_copy(_buffer + offset(head), bufferPtr, prewrap_len);
 
-        // pointer has reached the end of the buffer, reset to start
-        headPtr = _buffer;
+        // index has reached the end of the buffer, continue from the start
+        head = step(head, prewrap_len);
         // shift the buffer pointer up to the remaining data to copy
         bufferPtr += prewrap_len;
         total_transfered = prewrap_len;
         // get new remaining space
         max_len -= total_transfered;
     }
-    memcpy(headPtr, bufferPtr, max_len);
-    headPtr += max_len;
+    ringbuffer_copy(_buffer + offset(head), bufferPtr, max_len);
     total_transfered += max_len;
 
-    resumeInterrupts();
+    memoryBarrier();
+    headIdx = step(head, max_len);
+
     return total_transfered;
 }
-template <uint8_t N, uint8_t align> uint8_t RingBuffer<N,align>::store(const uint8_t c) {
-    pauseInterrupts();
+template <uint16_t N, uint8_t flags> uint8_t RingBuffer<N,flags>::store(const uint8_t c) {
+    section_t section;
 
-    if (isFull()) {
-        resumeInterrupts();
+    len_t head = headIdx;
+    if (usedSpace(head, tailIdx) >= capacity) {  // full
         return 0;
     }
 
     // insert char and step head
-    *(headPtr++) = c;
-    wrap_headPtr();
+    _buffer[offset(head)] = c;
+    memoryBarrier();
+    headIdx = step(head, 1);
 
-    resumeInterrupts();
     return 1;
 }
 
-template <uint8_t N, uint8_t align> uint8_t RingBuffer<N,align>::read_char() {
-    pauseInterrupts();
+template <uint16_t N, uint8_t flags> uint8_t RingBuffer<N,flags>::read_char() {
+    section_t section;
 
-    if (isEmpty()) {
-        resumeInterrupts();
+    len_t tail = tailIdx;
+    if (tail == headIdx) {  // empty
         /// TODO: what should we return when there isn't anything
         return 0;
     }
+    memoryBarrier();
 
     // pop char and step tail
-    uint8_t c = *(tailPtr++);
-    wrap_tailPtr();
+    uint8_t c = _buffer[offset(tail)];
+    memoryBarrier();
+    setTail(step(tail, 1));
 
-    resumeInterrupts();
     return c;
 }
-template <uint8_t N, uint8_t align> uint8_t RingBuffer<N,align>::read(uint8_t* buffer, uint8_t max_len) {
-    uint8_t total_transfered = 0;
+template <uint16_t N, uint8_t flags> typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::read(uint8_t* buffer, len_t max_len) {
+    len_t total_transfered = 0;
 
-    pauseInterrupts();
+    section_t section;
+    // work on a local copy of the tail so it is only published once the data has been copied out
+    len_t tail = tailIdx;
     // calculate max length from requested and available data
-    uint8_t total_len = min(max_len, usedSpace());
+    len_t total_len = min(max_len, usedSpace(headIdx, tail));
+    memoryBarrier();
 
-    // handle splitting on end pointer
-    if ((tailPtr + total_len) >= endPtr) {
-        uint8_t prewrap_len = (endPtr - 1) - tailPtr;
-        memcpy(buffer, tailPtr, prewrap_len);
+    // handle splitting at the end of the buffer
+    len_t prewrap_len = N - offset(tail);
+    if (total_len > prewrap_len) {
+        ringbuffer_copy(buffer, _buffer + offset(tail), prewrap_len);
 
-        // pointer has reached the end of the buffer, reset to start
-        tailPtr = _buffer;
+        // index has reached the end of the buffer, continue from the start
+        tail = step(tail, prewrap_len);
         // shift the buffer pointer up to where the rest of the data will be copied
         // note: we are only moving our local copy of the buffer pointer,
         // the full buffer will be available once the function returns
@@ -155,49 +231,122 @@ template <uint8_t N, uint8_t align> uint8_t RingBuffer<N,align>::read(uint8_t* b
         // get new remaining space
         total_len -= total_transfered;
     }
-    memcpy(buffer, tailPtr, total_len);
-    tailPtr += total_len;
+    ringbuffer_copy(buffer, _buffer + offset(tail), total_len);
     total_transfered += total_len;
 
-    resumeInterrupts();
+    memoryBarrier();
+    setTail(step(tail, total_len));
+
     return total_transfered;
 }
 
-template <uint8_t N, uint8_t align> void RingBuffer<N,align>::clear() {
-    pauseInterrupts();
-    headPtr = _buffer;
-    tailPtr = _buffer;
-    resumeInterrupts();
+template <uint16_t N, uint8_t flags> void RingBuffer<N,flags>::clear() {
+    section_t section;
+    len_t head = headIdx;
+    if ((sendIdx != tailIdx) && !(flags & BUFFER_LOCK_FREE)) {
+        // transfers are in flight, their completions still move the tail up to sendIdx.
+        // The unsent data after them is all that goes, this also keeps sendIdx aligned for TX_ALIGN
+        headIdx = sendIdx;
+    } else if (sendIdx != tailIdx) {
+        // as above but the head belongs to the producer, drop the rest once the transfers have completed
+        dropLen = usedSpace(head, tailIdx) - (usedSpace(sendIdx, tailIdx) - dropLen);
+        sendIdx = head;
+    } else if (flags & BUFFER_LOCK_FREE) {
+        // the head belongs to the producer, drop everything up to it instead
+        tailIdx = head;
+        sendIdx = head;
+        dropLen = 0;
+    } else {
+        headIdx = 0;
+        tailIdx = 0;
+        sendIdx = 0;
+        dropLen = 0;
+    }
 }
 
-template <uint8_t N, uint8_t align> uint8_t RingBuffer<N,align>::usedSpace() {
-    int16_t ptr_diff = headPtr - tailPtr;
+template <uint16_t N, uint8_t flags> inline typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::usedSpace(len_t head, len_t tail) {
+    if (pow2) {
+        // the unsigned difference of free-running indices is always the used space
+        return (len_t)(head - tail);
+    }
+
+    int32_t idx_diff = head - tail;
 
-    // account for wrapping at end pointer
-    if (ptr_diff < 0) {
-        ptr_diff = N + ptr_diff;
+    // account for wrapping at the end of the buffer
+    if (idx_diff < 0) {
+        idx_diff = N + idx_diff;
     }
-    return (uint8_t)(ptr_diff & 0xFF);
+    return (len_t)idx_diff;
 }
-template <uint8_t N, uint8_t align> uint8_t RingBuffer<N,align>::availableSpace() {
-    // at full the pointers are adjacent so 1 slot is always unusable
-    return (N - usedSpace() - 1);
+template <uint16_t N, uint8_t flags> inline void RingBuffer<N,flags>::setTail(len_t tail) {
+    if (sendIdx == tailIdx) {
+        sendIdx = tail;
+    }
+    tailIdx = tail;
+}
+template <uint16_t N, uint8_t flags> typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::usedSpace() {
+    return usedSpace(headIdx, tailIdx);
+}
+template <uint16_t N, uint8_t flags> typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::unsentSpace() {
+    return usedSpace(headIdx, sendIdx);
+}
+template <uint16_t N, uint8_t flags> typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::availableSpace() {
+    return (capacity - usedSpace());
 }
 
-template <uint8_t N, uint8_t align> bool RingBuffer<N,align>::isFull() {
+template <uint16_t N, uint8_t flags> bool RingBuffer<N,flags>::isFull() {
     return (!availableSpace());
 }
-template <uint8_t N, uint8_t align> bool RingBuffer<N,align>::isEmpty() {
-    return (headPtr == tailPtr);
+template <uint16_t N, uint8_t flags> bool RingBuffer<N,flags>::isEmpty() {
+    return (headIdx == tailIdx);
+}
+
+template <uint16_t N, uint8_t flags> typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::peek(RingBufferSpan regions[2]) {
+    len_t tail = tailIdx;
+    len_t used_len = usedSpace(headIdx, tail);
+    memoryBarrier();
+
+    // the first region runs up to the end of the buffer, any remaining data continues from the start
+    regions[0].data = _buffer + offset(tail);
+    regions[0].len = min(used_len, N - offset(tail));
+    regions[1].data = _buffer;
+    regions[1].len = used_len - regions[0].len;
+
+    return used_len;
+}
+template <uint16_t N, uint8_t flags> void RingBuffer<N,flags>::consume(len_t len) {
+    memoryBarrier();
+    setTail(step(tailIdx, len));
+}
+
+template <uint16_t N, uint8_t flags> typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::reserve(RingBufferSpan regions[2]) {
+    static_assert(!(flags & BUFFER_USB_TX_ALIGN) || (flags & BUFFER_LOCK_FREE),
+                  "reserve() requires BUFFER_LOCK_FREE when used with BUFFER_USB_TX_ALIGN");
+    len_t head = headIdx;
+    len_t free_len = capacity - usedSpace(head, tailIdx);
+    memoryBarrier();
+
+    // the first region runs up to the end of the buffer, any remaining space continues from the start
+    regions[0].data = _buffer + offset(head);
+    regions[0].len = min(free_len, N - offset(head));
+    regions[1].data = _buffer;
+    regions[1].len = free_len - regions[0].len;
+
+    return free_len;
+}
+template <uint16_t N, uint8_t flags> void RingBuffer<N,flags>::commit(len_t len) {
+    memoryBarrier();
+    headIdx = step(headIdx, len);
 }
 
 // these functions are not protected against interrupts since they should only be used by a single interrupt
-template <uint8_t N, uint8_t align> uint8_t* RingBuffer<N,align>::prepareDirectWrite(uint8_t* len) {
+template <uint16_t N, uint8_t flags> HOT_INLINE uint8_t* RingBuffer<N,flags>::prepareDirectWrite(len_t* len) {
+    len_t head = headIdx;
     // calculate maximum contiguous write length
-    uint8_t max_len = min((endPtr - headPtr), availableSpace());
+    len_t max_len = min((N - offset(head)), capacity - usedSpace(head, tailIdx));
 
     // if the head is already aligned nothing changes
-    if ((align & BUFFER_USB_RX_ALIGN) && (reinterpret_cast<uintptr_t>(headPtr) & 0x3)) {
+    if ((flags & BUFFER_USB_RX_ALIGN) && (offset(head) & 0x3)) {
         // when the head is unaligned we use an intermediate buffer so the DMA gets an aligned buffer
         *len = min(max_len, 8);
 
@@ -206,47 +355,99 @@ template <uint8_t N, uint8_t align> uint8_t* RingBuffer<N,align>::prepareDirectW
 
     *len = max_len;
 
-    return headPtr;
+    return _buffer + offset(head);
 }
-template <uint8_t N, uint8_t align> uint8_t* RingBuffer<N,align>::prepareDirectRead(uint8_t* len) {
+template <uint16_t N, uint8_t flags> HOT_INLINE uint8_t* RingBuffer<N,flags>::prepareDirectRead(len_t* len, len_t limit) {
+    // transfers still in flight are ahead of the tail, continue from the end of them
+    len_t send = sendIdx;
     // calculate maximum contiguous read length
-    uint8_t max_len = min((endPtr - tailPtr), usedSpace());
-
-    if (align & BUFFER_USB_TX_ALIGN) {
-        if (max_len < 4) {  // if there are less than 4 bytes to send, extra steps are needed
-            // push headPtr to the next alignment boundary
-            headPtr += 4 - max_len;
-            wrap_headPtr();
-            *len = max_len;
+    len_t max_len = min(min((N - offset(send)), usedSpace(headIdx, send)), limit);
+    memoryBarrier();
+
+    if ((flags & BUFFER_USB_TX_ALIGN) && (flags & BUFFER_LOCK_FREE)) {
+        len_t misalignment = offset(send) & 0x3;
+        if (misalignment) {
+            if (send != tailIdx) {
+                // the intermediate buffer may still be in use, wait for the outstanding transfers
+                *len = 0;
+                return _tx_buffer;
+            }
+            // copy enough data to bring the tail back onto a 32-bit boundary
+            *len = min(max_len, sizeof(_tx_buffer) - misalignment);
+            ringbuffer_copy(_tx_buffer, _buffer + offset(send), *len);
+            sendIdx = step(send, *len);
+
+            return _tx_buffer;
+        } else if (max_len >= 4) {
+            // restrict length to a multiple of 4 so the tail stays aligned
+            *len = (max_len & ~0x3);
         } else {
+            // the next transfer will realign the tail using the intermediate buffer
+            *len = max_len;
+        }
+        sendIdx = step(send, *len);
+    } else if (flags & BUFFER_USB_TX_ALIGN) {
+        if (max_len >= 4) {
             // restrict length to a multiple of 4 so that all transfers begin on a 32-bit boundary
             *len = (max_len & ~0x3);
+            sendIdx = step(send, *len);
+        } else if (max_len && (max_len == usedSpace(headIdx, send)) &&
+                   ((4 - max_len) <= (capacity - usedSpace(headIdx, tailIdx)))) {
+            // the last few bytes queued, push the head to the next alignment boundary.
+            // Sizes that aren't a power of two can be too full for that, it then waits for the transfers in flight
+            headIdx = step(headIdx, 4 - max_len);
+            *len = max_len;
+            sendIdx = step(send, 4);
+        } else {
+            // nothing to send, or a limit below 4 with more data behind it which can't be padded
+            *len = 0;
         }
     } else {
         *len = max_len;
+        sendIdx = step(send, *len);
     }
 
-    return tailPtr;
+    return _buffer + offset(send);
 }
 
-template <uint8_t N, uint8_t align> void RingBuffer<N,align>::completeDirectWrite(uint8_t len) {
+template <uint16_t N, uint8_t flags> HOT_INLINE typename RingBuffer<N,flags>::len_t RingBuffer<N,flags>::prepareCopyRead(uint8_t* buffer, len_t limit) {
+    static_assert(!(flags & BUFFER_USB_TX_ALIGN) || (flags & BUFFER_LOCK_FREE),
+                  "prepareCopyRead() requires BUFFER_LOCK_FREE when used with BUFFER_USB_TX_ALIGN");
+    len_t send = sendIdx;
+    len_t len = min(usedSpace(headIdx, send), limit);
+    memoryBarrier();
+
+    // handle splitting at the end of the buffer
+    len_t prewrap_len = min(len, N - offset(send));
+    ringbuffer_copy(buffer, _buffer + offset(send), prewrap_len);
+    ringbuffer_copy(buffer + prewrap_len, _buffer, len - prewrap_len);
+
+    sendIdx = step(send, len);
+    return len;
+}
+
+template <uint16_t N, uint8_t flags> HOT_INLINE void RingBuffer<N,flags>::completeDirectWrite(len_t len) {
+    len_t head = headIdx;
     // if the head was aligned we wrote directly to the buffer
-    if ((align & BUFFER_USB_RX_ALIGN) && (reinterpret_cast<uintptr_t>(headPtr) & 0x3)) {
+    if ((flags & BUFFER_USB_RX_ALIGN) && (offset(head) & 0x3)) {
         // move data from the intermediate buffer
-        memcpy(headPtr, _rx_buffer, len);
+        ringbuffer_copy(_buffer + offset(head), _rx_buffer, len);
     }
 
-    headPtr += len;
-    wrap_headPtr();
+    commit(len);
 }
-template <uint8_t N, uint8_t align> void RingBuffer<N,align>::completeDirectRead(uint8_t len) {
-    if ((align & BUFFER_USB_TX_ALIGN) && (len & 0x3)) {
+template <uint16_t N, uint8_t flags> HOT_INLINE void RingBuffer<N,flags>::completeDirectRead(len_t len) {
+    if ((flags & BUFFER_USB_TX_ALIGN) && !(flags & BUFFER_LOCK_FREE) && (len & 0x3)) {
         // round up to the next alignment boundary
         len = (len & ~0x3) + 4;
     }
 
-    tailPtr += len;
-    wrap_tailPtr();
+    consume(len);
+    if (dropLen && (usedSpace(sendIdx, tailIdx) == dropLen)) {
+        // the last transfer in flight when the buffer was cleared
+        consume(dropLen);
+        dropLen = 0;
+    }
 }
 
 #endif
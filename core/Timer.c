@@ -0,0 +1,297 @@
+#include <samd.h>
+#include "generic.h"
+#include "Timer.h"
+#include "Deferred.h"
+
+/*
+ * Hierarchical timing wheel, each level has 64 slots and each slot covers 64 times the ticks of the
+ * slot below it. A timer is put in the lowest level that reaches its expiry, and is moved down a level
+ * when the wheel below wraps around to its slot. Each tick only looks at one slot of the first level,
+ * moving a slot down is shared between every tick of the lower level.
+ * Timers further away than the wheel covers wait in the last level and are re-inserted until due.
+ * Built with TICKLESS_IDLE the RTC only wakes the core for the next slot that has something in it,
+ * the wheel is then caught up with every ms that passed.
+ */
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SLOTS - 1)
+#define TIMER_LEVELS 4
+
+#define TIMER_IDLE    0
+#define TIMER_ARMED   1
+#define TIMER_EXPIRED 2  // waiting for its callback to be run
+
+static soft_timer_t* _wheel[TIMER_LEVELS][TIMER_LEVEL_SLOTS];
+static volatile uint32_t _timerNow = 0;
+static uint16_t _timersArmed = 0;
+
+// expired timers in expiry order
+static soft_timer_t* _expiredHead = NULL;
+static soft_timer_t* _expiredTail = NULL;
+
+static void timerWork(void* arg) {
+    (void)arg;
+    timer_dispatch();
+}
+static deferred_work_t _timerWork = DEFERRED_WORK_INIT(timerWork, NULL);
+
+static inline uint32_t timerLock(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+static inline void timerUnlock(uint32_t primask) {
+    if (!primask) {
+        __enable_irq();
+    }
+}
+
+static void timerAdvance(void);
+static void timerScheduleWakeup(void);
+
+// the slot that holds a timer depends on how far away its expiry is
+static soft_timer_t** wheelSlot(uint32_t expires) {
+    uint32_t delta = expires - _timerNow;
+    uint8_t level = 0;
+    while ((level < (TIMER_LEVELS - 1)) && (delta >= ((uint32_t)1 << (TIMER_LEVEL_BITS * (level + 1))))) {
+        level++;
+    }
+    if (level == (TIMER_LEVELS - 1) && (delta >> (TIMER_LEVEL_BITS * TIMER_LEVELS))) {
+        // beyond the wheel, wait in the furthest slot and be re-inserted when it is reached
+        expires = _timerNow + ((uint32_t)TIMER_LEVEL_MASK << (TIMER_LEVEL_BITS * level));
+    }
+    return &_wheel[level][(expires >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK];
+}
+
+static void wheelInsert(soft_timer_t* timer) {
+    soft_timer_t** slot = wheelSlot(timer->expires);
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+}
+
+static void wheelRemove(soft_timer_t* timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+}
+
+void timer_init(soft_timer_t* timer, timer_callback_t callback, void* arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = NULL;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->period = 0;
+    timer->state = TIMER_IDLE;
+}
+
+void timer_start(soft_timer_t* timer, uint32_t delay_ms, uint32_t period_ms) {
+    uint32_t primask = timerLock();
+    timer_cancel(timer);
+
+#ifdef TICKLESS_IDLE
+    // the wheel is only up to date after a wakeup
+    timerAdvance();
+#endif
+    timer->expires = _timerNow + ((delay_ms) ? delay_ms : 1);
+    timer->period = period_ms;
+    timer->state = TIMER_ARMED;
+    wheelInsert(timer);
+    _timersArmed++;
+    timerScheduleWakeup();
+
+    timerUnlock(primask);
+}
+
+void timer_cancel(soft_timer_t* timer) {
+    uint32_t primask = timerLock();
+
+    if (timer->state == TIMER_ARMED) {
+        wheelRemove(timer);
+        _timersArmed--;
+    } else if (timer->state == TIMER_EXPIRED) {
+        // take it out of the expired queue
+        if (timer->prev) {
+            timer->prev->next = timer->next;
+        } else {
+            _expiredHead = timer->next;
+        }
+        if (timer->next) {
+            timer->next->prev = timer->prev;
+        } else {
+            _expiredTail = timer->prev;
+        }
+    }
+    timer->state = TIMER_IDLE;
+
+    timerUnlock(primask);
+}
+
+bool timer_running(soft_timer_t* timer) {
+    return timer->state != TIMER_IDLE;
+}
+
+// move every timer in a slot down to the level that now covers it
+static void cascade(uint8_t level) {
+    soft_timer_t** slot = &_wheel[level][(_timerNow >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK];
+    soft_timer_t* timer = *slot;
+    *slot = NULL;
+
+    while (timer) {
+        soft_timer_t* next = timer->next;
+        wheelInsert(timer);
+        timer = next;
+    }
+}
+
+#ifdef TICKLESS_IDLE
+// ms until the wheel next has something to do, a timer expiring or a slot moving down a level.
+// Only called while timers are armed, so at least one slot isn't empty.
+static uint32_t nextEvent(void) {
+    uint32_t next = UINT32_MAX;
+    for (uint8_t level = 0; level < TIMER_LEVELS; level++) {
+        uint8_t shift = TIMER_LEVEL_BITS * level;
+        uint32_t position = _timerNow >> shift;
+        // a full turn reaches the current slot again, which can hold timers a turn away
+        for (uint32_t ahead = 1; ahead <= TIMER_LEVEL_SLOTS; ahead++) {
+            if (_wheel[level][(position + ahead) & TIMER_LEVEL_MASK]) {
+                // slots above the first level are reached when the levels below wrap
+                uint32_t delta = ((position + ahead) << shift) - _timerNow;
+                if (delta < next) {
+                    next = delta;
+                }
+                break;
+            }
+        }
+    }
+    return next;
+}
+#endif
+
+// With SysTick timer_tick runs every ms, tickless the RTC is asked to wake for the next event
+static void timerScheduleWakeup(void) {
+#ifdef TICKLESS_IDLE
+    if (_timersArmed) {
+        requestWakeup(_timerNow + nextEvent());
+    }
+#endif
+}
+
+// advance the wheel by 1ms, returns true if any timer expired
+static bool timerStep(void) {
+    _timerNow++;
+
+    // when a level wraps, the next slot of the level above is due to be spread over it
+    for (uint8_t level = 1; level < TIMER_LEVELS; level++) {
+        if (_timerNow & (((uint32_t)1 << (TIMER_LEVEL_BITS * level)) - 1)) {
+            break;
+        }
+        cascade(level);
+    }
+
+    soft_timer_t** slot = &_wheel[0][_timerNow & TIMER_LEVEL_MASK];
+    soft_timer_t* timer = *slot;
+    *slot = NULL;
+    bool expired = false;
+
+    while (timer) {
+        soft_timer_t* next = timer->next;
+        if (timer->expires != _timerNow) {
+            // a timer from beyond the wheel that isn't due yet
+            wheelInsert(timer);
+        } else {
+            // queue the callback
+            _timersArmed--;
+            timer->state = TIMER_EXPIRED;
+            timer->next = NULL;
+            timer->prev = _expiredTail;
+            if (_expiredTail) {
+                _expiredTail->next = timer;
+            } else {
+                _expiredHead = timer;
+            }
+            _expiredTail = timer;
+            expired = true;
+        }
+        timer = next;
+    }
+    return expired;
+}
+
+// bring the wheel up to date, queueing the callbacks of timers that expired
+static void timerAdvance(void) {
+    bool expired = false;
+#ifdef TICKLESS_IDLE
+    // catch up with the ms since the last wakeup, jumping over the empty slots between events
+    uint32_t now = millis();
+    while ((int32_t)(now - _timerNow) > 0) {
+        uint32_t skip = (_timersArmed) ? (nextEvent() - 1) : UINT32_MAX;
+        if (skip >= (now - _timerNow)) {
+            // nothing else is due yet
+            _timerNow = now;
+            break;
+        }
+        _timerNow += skip;
+        expired |= timerStep();
+    }
+#else
+    if (_timersArmed) {
+        expired = timerStep();
+    }
+#endif
+
+    if (expired) {
+        deferred_post(&_timerWork);
+    }
+}
+
+HOT_RAMFUNC
+void timer_tick(void) {
+    if (!_timersArmed) {
+        // nothing to time, the wheel position doesn't matter
+        return;
+    }
+    timerAdvance();
+    timerScheduleWakeup();
+}
+
+void timer_dispatch(void) {
+    while (true) {
+        uint32_t primask = timerLock();
+        soft_timer_t* timer = _expiredHead;
+        if (!timer) {
+            timerUnlock(primask);
+            return;
+        }
+        _expiredHead = timer->next;
+        if (_expiredHead) {
+            _expiredHead->prev = NULL;
+        } else {
+            _expiredTail = NULL;
+        }
+
+        timer->state = TIMER_IDLE;
+        if (timer->period) {
+            // re-arm from when it was due so the period doesn't drift
+            uint32_t expires = timer->expires + timer->period;
+            timer->expires = ((int32_t)(expires - _timerNow) > 0) ? expires : (_timerNow + 1);
+            timer->state = TIMER_ARMED;
+            wheelInsert(timer);
+            _timersArmed++;
+            timerScheduleWakeup();
+        }
+        timerUnlock(primask);
+
+        timer->callback(timer->arg);
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Software timers with 1ms resolution, driven from the system tick.
+// Timers are kept in a hierarchical timing wheel so starting, cancelling and each tick
+// take the same time however many timers are running.
+// Callbacks run as deferred work from PendSV at the lowest interrupt priority, not from the tick interrupt.
+
+typedef void (*timer_callback_t)(void* arg);
+
+typedef struct soft_timer {
+    struct soft_timer* next;
+    struct soft_timer* prev;
+    struct soft_timer** slot;  // wheel slot holding the timer
+    uint32_t expires;  // tick the timer is due on
+    uint32_t period;   // ms between repeats, 0 for a one-shot timer
+    timer_callback_t callback;
+    void* arg;
+    volatile uint8_t state;
+} soft_timer_t;
+
+// set the callback of a timer, must be called before the timer is first started
+void timer_init(soft_timer_t* timer, timer_callback_t callback, void* arg);
+// run callback after delay_ms, then every period_ms if period_ms isn't 0.
+// Restarts the timer if it is already running.
+void timer_start(soft_timer_t* timer, uint32_t delay_ms, uint32_t period_ms);
+// stop the timer, its callback won't run unless it is already running
+void timer_cancel(soft_timer_t* timer);
+bool timer_running(soft_timer_t* timer);
+
+// advance the wheel by 1ms, called from the tick interrupt.
+// Tickless it is called when the requested wakeup is reached and catches up to millis()
+void timer_tick(void);
+// run the callbacks of expired timers, posted as deferred work by timer_tick
+void timer_dispatch(void);
+
+#ifdef __cplusplus
+}
+#endif
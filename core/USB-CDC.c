@@ -1,6 +1,11 @@
 #include "USB-CDC.h"
+#include "Async.h"
 
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+USB_ENDPOINTS(4);
+#else
 USB_ENDPOINTS(3);
+#endif
 
 // USB serial function prototypes
 void usbserial_init();
@@ -10,11 +15,57 @@ void usbserial_init();
 static uint8_t* (*usbserial_tx_callback)(uint8_t, uint8_t*) = NULL;
 // buffer, len, new_len -> new_buffer, set new_buffer to NULL to skip next transfer
 static uint8_t* (*usbserial_rx_callback)(uint8_t*, uint8_t, uint8_t*) = NULL;
+// run from SysTick each ms
+static void (*usbserial_tick_callback)(void) = NULL;
+// run from PendSV
 
-static uint8_t* usbserial_current_tx_buffer = NULL;
-static uint8_t* usbserial_current_rx_buffer = NULL;
+// Everything but acknowledging interrupts is deferred out of the USB and SysTick interrupts,
+// the callbacks and buffer bookkeeping run as deferred work from PendSV.
+static void usbserial_completion_work(void* arg);
+static void usbserial_tick_work(void* arg);
+static deferred_work_t usbserial_completion_deferred = DEFERRED_WORK_INIT(usbserial_completion_work, NULL);
+static deferred_work_t usbserial_tick_deferred = DEFERRED_WORK_INIT(usbserial_tick_work, NULL);
+static volatile bool usbserial_configure_pending = false;
+static volatile uint8_t usbserial_pending_ticks = 0;
 
+static void usbserial_configure(void);
+
+static uint8_t* usbserial_current_rx_buffer = NULL;
+#ifndef USB_SERIAL_DOUBLE_BUFFER
+static uint8_t* usbserial_current_tx_buffer = NULL;
 static uint8_t usbserial_current_tx_length = 0;
+static uint8_t usbserial_current_rx_length = 0;
+#endif
+
+static void usbserial_rx_transfer(uint8_t* completed, uint8_t len);
+
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+#ifdef USB_SERIAL_ECHO
+#error "USB_SERIAL_ECHO re-uses its receive buffer so can't be used with USB_SERIAL_DOUBLE_BUFFER"
+#endif
+
+// Both hardware banks of each CDC data endpoint are used for the same direction,
+// so one bank stays armed while the completion of the other is handled.
+// The hardware alternates between the banks so transfers complete in the order they were armed.
+typedef struct {
+    uint8_t* buffer[2];
+    uint8_t length[2];
+    uint8_t next_arm;   // bank to arm next
+    uint8_t next_done;  // bank that will complete next
+    uint8_t armed;      // number of banks armed
+} usbserial_banks_t;
+
+static usbserial_banks_t usbserial_in_banks;
+static usbserial_banks_t usbserial_out_banks;
+
+#define USB_EP_SIZE_64       0x3
+#define USB_EPTYPE_BULK      0x3
+#define USB_EPTYPE_DUAL_BANK 0x5  // use the other direction's bank as a second bank
+
+static void usbserial_arm_bank(uint8_t ep, uint8_t* buffer, uint8_t len);
+static void usbserial_enable_dual_bank_ep(uint8_t ep);
+static bool usbserial_bank_completed(uint8_t ep, uint8_t** buffer, uint8_t* len);
+#endif
 
 
 USB_ALIGN const USB_DeviceDescriptor device_descriptor = {
@@ -221,6 +272,8 @@ void usb_cb_control_setup(void) {
                     case CDC_SET_CONTROL_LINE_STATE: {
                         _usbCtrlLineInfo = usb_setup.wValue & 0xff;
                         detectSerialReset(_usbLineInfo.baud_rate, _usbCtrlLineInfo);
+                        // isOpen() changes outside of the deferred work, tasks waiting on it must be checked again
+                        async_wake();
                         usb_ep0_in(0);
                         return usb_ep0_out();
                     }
@@ -256,22 +309,72 @@ void usb_cb_control_out_completion(void) {
     }
 }
 
+// The transfer complete flags of the CDC data endpoints
+static inline uint8_t usbserial_ep_flags(uint8_t ep) {
+    return USB->DEVICE.DeviceEndpoint[ep & 0x3f].EPINTFLAG.reg & (USB_DEVICE_EPINTFLAG_TRCPT0 | USB_DEVICE_EPINTFLAG_TRCPT1);
+}
+// Stop the CDC data endpoint completions interrupting until the deferred work has handled them
+static void usbserial_mask_completions(bool mask) {
+    uint8_t flags = USB_DEVICE_EPINTENSET_TRCPT0 | USB_DEVICE_EPINTENSET_TRCPT1;
+    if (mask) {
+        USB->DEVICE.DeviceEndpoint[USB_EP_CDC_OUT & 0x3f].EPINTENCLR.reg = flags;
+        USB->DEVICE.DeviceEndpoint[USB_EP_CDC_IN & 0x3f].EPINTENCLR.reg = flags;
+    } else {
+        USB->DEVICE.DeviceEndpoint[USB_EP_CDC_OUT & 0x3f].EPINTENSET.reg = flags;
+        USB->DEVICE.DeviceEndpoint[USB_EP_CDC_IN & 0x3f].EPINTENSET.reg = flags;
+    }
+}
+
 /// Callback on a completion interrupt
+HOT_RAMFUNC
 void usb_cb_completion(void) {
-    if (usb_ep_pending(USB_EP_CDC_OUT)) {
+    // the flags are left set for the deferred work to handle
+    if (usbserial_ep_flags(USB_EP_CDC_OUT) || usbserial_ep_flags(USB_EP_CDC_IN)) {
+        usbserial_mask_completions(true);
+        deferred_post(&usbserial_completion_deferred);
+    }
+}
+
+// Handle the completed transfers, runs as deferred work
+HOT_RAMFUNC
+static void usbserial_completion_work(void* arg) {
+    (void)arg;
+    if (usbserial_configure_pending) {
+        usbserial_configure_pending = false;
+        usbserial_configure();
+    }
+
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+    uint8_t* buffer;
+    uint8_t len;
+
+    // handle every completed bank in the order they were armed
+    while (usbserial_bank_completed(USB_EP_CDC_OUT, &buffer, &len)) {
+        usbserial_rx_transfer(buffer, len);
+    }
+    while (usbserial_bank_completed(USB_EP_CDC_IN, &buffer, &len)) {
+        usbserial_run_tx_callback(len);
+    }
+#else
+    // single bank endpoints receive into bank 0 and send from bank 1
+    if (usbserial_ep_flags(USB_EP_CDC_OUT) & USB_DEVICE_EPINTFLAG_TRCPT0) {
         // if a host to device serial transmission was pending
         // run the callback and mark it as completed
         usb_ep_handled(USB_EP_CDC_OUT);
         uint8_t len = (uint8_t)(usb_ep_out_length(USB_EP_CDC_OUT) & 0xFF);
-        usbserial_run_rx_callback(len);
+        usbserial_rx_transfer(usbserial_current_rx_buffer, len);
     }
 
-    if (usb_ep_pending(USB_EP_CDC_IN)) {
+    if (usbserial_ep_flags(USB_EP_CDC_IN) & USB_DEVICE_EPINTFLAG_TRCPT1) {
         // if a device to host serial transmission was pending,
         // run the callback and mark it as completed
         usb_ep_handled(USB_EP_CDC_IN);
         usbserial_run_tx_callback(usbserial_current_tx_length);
     }
+#endif
+
+    // any transfers that completed since they were checked interrupt again straight away
+    usbserial_mask_completions(false);
 }
 
 /// Callback for a SET_INTERFACE request
@@ -301,37 +404,83 @@ uint8_t usbserial_active_tx_buf = 0;
 USB_ALIGN uint8_t usbserial_buf[4][64];
 #endif
 
-// called by the SET_CONFIGURATION callback when the CDC configuration is selected
+// called by the SET_CONFIGURATION callback when the CDC configuration is selected,
+// the endpoints are configured by the deferred work as soon as the interrupt returns
 void usbserial_init() {
+    usbserial_configure_pending = true;
+    deferred_post(&usbserial_completion_deferred);
+}
+
+static void usbserial_configure(void) {
     // configure the USB endpoints
     usb_enable_ep(USB_EP_CDC_NOTIFICATION, USB_EP_TYPE_INTERRUPT, 8);
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+    usbserial_enable_dual_bank_ep(USB_EP_CDC_OUT);
+    usbserial_enable_dual_bank_ep(USB_EP_CDC_IN);
+#else
     usb_enable_ep(USB_EP_CDC_OUT, USB_EP_TYPE_BULK, 64);
     usb_enable_ep(USB_EP_CDC_IN, USB_EP_TYPE_BULK, 64);
+#endif
 
 #ifdef USB_SERIAL_ECHO
     usbserial_set_rx_callback(usbserial_out_completion);
 #endif
 
+#ifndef USB_SERIAL_DOUBLE_BUFFER
+    // transfers running when the configuration was reset were lost, restart them
+    if (usbserial_current_tx_buffer) {
+        usb_ep_start_in(USB_EP_CDC_IN, usbserial_current_tx_buffer, usbserial_current_tx_length, false);
+    } else {
+        usbserial_run_tx_callback(0);
+    }
+    if (usbserial_current_rx_buffer) {
+        usb_ep_start_out(USB_EP_CDC_OUT, usbserial_current_rx_buffer, usbserial_current_rx_length);
+    } else {
+        usbserial_run_rx_callback(0);
+    }
+#else
     // if callbacks configured, run them
     usbserial_run_tx_callback(0);
     usbserial_run_rx_callback(0);
+#endif
 }
 
 // Configure callbacks for USB serial
+// the completion work can't run part way through changing a callback
 void usbserial_set_tx_callback(uint8_t* (*new_tx_isr)(uint8_t, uint8_t*)) {
+    deferred_lock();
     usbserial_tx_callback = new_tx_isr;
     if (usb_ep_ready(USB_EP_CDC_IN)) { // if endpoint active
         usbserial_run_tx_callback(0);
     }
+    deferred_unlock();
 }
 void usbserial_set_rx_callback(uint8_t* (*new_rx_isr)(uint8_t*, uint8_t, uint8_t*)) {
+    deferred_lock();
     usbserial_rx_callback = new_rx_isr;
     if (usb_ep_ready(USB_EP_CDC_IN)) { // if endpoint active
         usbserial_run_rx_callback(0);
     }
+    deferred_unlock();
 }
 
+// A length of 0 starts a transfer if there isn't one running,
+// otherwise len bytes of the running transfer were sent.
+// The callback must return the buffers in order and only report each one as complete once.
+HOT_RAMFUNC
 void usbserial_run_tx_callback(uint8_t len){
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+    // keep both banks armed while the callback has data
+    while (usbserial_tx_callback && (usbserial_in_banks.armed < 2)) {
+        uint8_t new_len;
+        uint8_t* buffer = usbserial_tx_callback(len, &new_len);
+        len = 0;  // only report the completion once
+        if (!buffer) {
+            break;
+        }
+        usbserial_arm_bank(USB_EP_CDC_IN, buffer, new_len);
+    }
+#else
     if (usbserial_tx_callback) {
         uint8_t* buffer = usbserial_tx_callback(len, &usbserial_current_tx_length);
         usbserial_current_tx_buffer = buffer;
@@ -342,18 +491,152 @@ void usbserial_run_tx_callback(uint8_t len){
         usbserial_current_tx_buffer = NULL;
         usbserial_current_tx_length = 0;
     }
+#endif
 }
+// A length of 0 starts a transfer if there isn't one running,
+// otherwise len bytes were received into the running transfer.
 void usbserial_run_rx_callback(uint8_t len){
-    if (usbserial_rx_callback) {
+    usbserial_rx_transfer((len) ? usbserial_current_rx_buffer : NULL, len);
+}
+
+// completed is the buffer that received len bytes, NULL if this is only to start a transfer.
+// Empty packets are reported as completed so transfers always complete in the order they were started.
+HOT_RAMFUNC
+static void usbserial_rx_transfer(uint8_t* completed, uint8_t len) {
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+    // keep both banks armed while the callback has space
+    while (usbserial_rx_callback && (usbserial_out_banks.armed < 2)) {
         uint8_t new_len;
-        uint8_t* buffer = usbserial_rx_callback(usbserial_current_rx_buffer, len, &new_len);
+        uint8_t* buffer = usbserial_rx_callback(completed, len, &new_len);
+        completed = NULL;  // only report the completion once
+        len = 0;
+        if (!buffer) {
+            break;
+        }
+        usbserial_arm_bank(USB_EP_CDC_OUT, buffer, new_len);
+    }
+#else
+    if (usbserial_rx_callback) {
+        uint8_t* buffer = usbserial_rx_callback(completed, len, &usbserial_current_rx_length);
         usbserial_current_rx_buffer = buffer;
         if (buffer) {
-            usb_ep_start_out(USB_EP_CDC_OUT, buffer, new_len); // start a rx transfer
+            usb_ep_start_out(USB_EP_CDC_OUT, buffer, usbserial_current_rx_length); // start a rx transfer
         }
     } else {
         usbserial_current_rx_buffer = NULL;
     }
+#endif
+}
+
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+// Configure an endpoint to use both banks for its direction, any transfers that were armed are restarted
+static void usbserial_enable_dual_bank_ep(uint8_t ep) {
+    usbserial_banks_t* banks = (ep & 0x80) ? &usbserial_in_banks : &usbserial_out_banks;
+    usbserial_banks_t armed = *banks;
+    UsbDeviceEndpoint* regs = &USB->DEVICE.DeviceEndpoint[ep & 0x3f];
+
+    usb_endpoints[ep & 0x3f].DeviceDescBank[0].PCKSIZE.bit.SIZE = USB_EP_SIZE_64;
+    usb_endpoints[ep & 0x3f].DeviceDescBank[1].PCKSIZE.bit.SIZE = USB_EP_SIZE_64;
+
+    if (ep & 0x80) {
+        regs->EPCFG.reg = USB_DEVICE_EPCFG_EPTYPE1(USB_EPTYPE_BULK) | USB_DEVICE_EPCFG_EPTYPE0(USB_EPTYPE_DUAL_BANK);
+        // IN banks are ready when they hold data to send
+        regs->EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK0RDY | USB_DEVICE_EPSTATUSCLR_BK1RDY;
+    } else {
+        regs->EPCFG.reg = USB_DEVICE_EPCFG_EPTYPE0(USB_EPTYPE_BULK) | USB_DEVICE_EPCFG_EPTYPE1(USB_EPTYPE_DUAL_BANK);
+        // OUT banks are ready when they hold received data, keep them full until they are armed
+        regs->EPSTATUSSET.reg = USB_DEVICE_EPSTATUSSET_BK0RDY | USB_DEVICE_EPSTATUSSET_BK1RDY;
+    }
+    // start from bank 0 with DATA0
+    regs->EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_CURBK | USB_DEVICE_EPSTATUSCLR_DTGLIN | USB_DEVICE_EPSTATUSCLR_DTGLOUT;
+    regs->EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT0 | USB_DEVICE_EPINTFLAG_TRCPT1;
+
+    banks->next_arm = 0;
+    banks->next_done = 0;
+    banks->armed = 0;
+    // the buffers were handed out by the callback in order, give them back to the endpoint in the same order
+    for (uint8_t i = 0; i < armed.armed; i++) {
+        uint8_t bank = armed.next_done ^ i;
+        usbserial_arm_bank(ep, armed.buffer[bank], armed.length[bank]);
+    }
+}
+
+HOT_RAMFUNC
+static void usbserial_arm_bank(uint8_t ep, uint8_t* buffer, uint8_t len) {
+    usbserial_banks_t* banks = (ep & 0x80) ? &usbserial_in_banks : &usbserial_out_banks;
+    uint8_t bank = banks->next_arm;
+    UsbDeviceDescBank* desc = &usb_endpoints[ep & 0x3f].DeviceDescBank[bank];
+    UsbDeviceEndpoint* regs = &USB->DEVICE.DeviceEndpoint[ep & 0x3f];
+
+    banks->buffer[bank] = buffer;
+    banks->length[bank] = len;
+    banks->next_arm ^= 1;
+    banks->armed++;
+
+    desc->ADDR.reg = (uintptr_t)buffer;
+    regs->EPINTFLAG.reg = (bank) ? USB_DEVICE_EPINTFLAG_TRCPT1 : USB_DEVICE_EPINTFLAG_TRCPT0;
+    regs->EPINTENSET.reg = USB_DEVICE_EPINTENSET_TRCPT0 | USB_DEVICE_EPINTENSET_TRCPT1;
+
+    if (ep & 0x80) {
+        desc->PCKSIZE.bit.MULTI_PACKET_SIZE = 0;
+        desc->PCKSIZE.bit.BYTE_COUNT = len;
+        // data is ready to send
+        regs->EPSTATUSSET.reg = (bank) ? USB_DEVICE_EPSTATUSSET_BK1RDY : USB_DEVICE_EPSTATUSSET_BK0RDY;
+    } else {
+        desc->PCKSIZE.bit.MULTI_PACKET_SIZE = len;
+        desc->PCKSIZE.bit.BYTE_COUNT = 0;
+        // bank is free to receive
+        regs->EPSTATUSCLR.reg = (bank) ? USB_DEVICE_EPSTATUSCLR_BK1RDY : USB_DEVICE_EPSTATUSCLR_BK0RDY;
+    }
+}
+
+// returns true and the transfer's buffer and length if the next bank to complete has done so
+HOT_RAMFUNC
+static bool usbserial_bank_completed(uint8_t ep, uint8_t** buffer, uint8_t* len) {
+    usbserial_banks_t* banks = (ep & 0x80) ? &usbserial_in_banks : &usbserial_out_banks;
+    uint8_t bank = banks->next_done;
+    uint8_t flag = (bank) ? USB_DEVICE_EPINTFLAG_TRCPT1 : USB_DEVICE_EPINTFLAG_TRCPT0;
+    UsbDeviceEndpoint* regs = &USB->DEVICE.DeviceEndpoint[ep & 0x3f];
+
+    if (!banks->armed || !(regs->EPINTFLAG.reg & flag)) {
+        return false;
+    }
+    regs->EPINTFLAG.reg = flag;
+
+    *buffer = banks->buffer[bank];
+    if (ep & 0x80) {
+        *len = banks->length[bank];
+    } else {
+        *len = usb_endpoints[ep & 0x3f].DeviceDescBank[bank].PCKSIZE.bit.BYTE_COUNT;
+    }
+    banks->next_done ^= 1;
+    banks->armed--;
+    return true;
+}
+#endif
+
+void usbserial_set_tick_callback(void (*new_tick_isr)(void)) {
+    usbserial_tick_callback = new_tick_isr;
+}
+void usbserial_tick() {
+    // count the ticks in case the work doesn't run before the next one
+    usbserial_pending_ticks++;
+    deferred_post(&usbserial_tick_deferred);
+}
+static void usbserial_tick_work(void* arg) {
+    (void)arg;
+    while (true) {
+        __disable_irq();
+        uint8_t ticks = usbserial_pending_ticks;
+        usbserial_pending_ticks = 0;
+        __enable_irq();
+        if (!ticks) {
+            return;
+        }
+        while (ticks-- && usbserial_tick_callback) {
+            usbserial_tick_callback();
+        }
+    }
 }
 
 uint8_t usbserial_get_line_info() {
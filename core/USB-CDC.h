@@ -12,6 +12,7 @@ extern "C" {
 #include "samd/usb_samd.h"
 #include "class/cdc/cdc_standard.h"
 #include "Reset.h"
+#include "Deferred.h"
 
 // https://cscott.net/usb_dev/data/devclass/usbcdc11.pdf
 #define ACM_SUPPORT_LINE_CODING 0x02
@@ -25,7 +26,12 @@ extern "C" {
 
 #define USB_EP_CDC_NOTIFICATION 0x81
 #define USB_EP_CDC_IN           0x82
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+// dual-bank endpoints use both banks for one direction so IN and OUT need separate endpoint numbers
+#define USB_EP_CDC_OUT          0x03
+#else
 #define USB_EP_CDC_OUT          0x02
+#endif
 
 uint8_t usbserial_get_line_info();
 uint32_t usbserial_get_baudrate();
@@ -37,6 +43,10 @@ void usbserial_set_rx_callback(uint8_t* (*new_rx_isr)(uint8_t*, uint8_t, uint8_t
 void usbserial_run_tx_callback(uint8_t len);
 void usbserial_run_rx_callback(uint8_t len);
 
+// called by SysTick each ms, the tick callback runs as deferred work
+void usbserial_set_tick_callback(void (*new_tick_isr)(void));
+void usbserial_tick();
+
 #ifdef __cplusplus
 }
 #endif
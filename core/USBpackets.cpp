@@ -0,0 +1,220 @@
+#include "USBpackets.h"
+
+#if !defined(USB_RESET_ONLY) && defined(USB_SERIAL_PACKET_MODE)
+
+// buffer states
+#define PACKET_FREE    0  // in the pool
+#define PACKET_OWNED   1  // held by the application, from allocate() or receive()
+#define PACKET_QUEUED  2  // submitted, waiting to be sent or in flight
+#define PACKET_RX      3  // given to the OUT endpoint or received and waiting for receive()
+
+USBpackets::USBpackets() {
+    usbserial_set_tx_callback(usbpackets_send_data_cb);
+    usbserial_set_rx_callback(usbpackets_receive_data_cb);
+}
+void USBpackets::_del() {
+    // remove callbacks
+    usbserial_set_tx_callback(NULL);
+    usbserial_set_rx_callback(NULL);
+}
+
+
+uint8_t* USBpackets::allocate() {
+    DeferredSection section;
+    return takeBuffer(PACKET_OWNED);
+}
+
+bool USBpackets::submit(uint8_t* packet, uint8_t len) {
+    uint8_t idx = poolIndex(packet);
+    if ((idx >= USB_PACKET_POOL_SIZE) || (state[idx] != PACKET_OWNED) || !len || (len > USB_PACKET_SIZE)) {
+        return false;
+    }
+
+    length[idx] = len;
+    state[idx] = PACKET_QUEUED;
+    uint8_t head = txHead;
+    txQueue[head & queueMask] = idx;
+    __DMB();
+    txHead = head + 1;
+
+    startTransmit();
+    return true;
+}
+
+uint8_t* USBpackets::receive(uint8_t* len) {
+    uint8_t tail = rxTail;
+    if (tail == rxHead) {
+        *len = 0;
+        return NULL;
+    }
+    __DMB();
+
+    uint8_t idx = rxQueue[tail & queueMask];
+    *len = length[idx];
+    state[idx] = PACKET_OWNED;
+    rxTail = tail + 1;
+
+    // the packet no longer counts against the receive limit
+    startReceive();
+    return pool[idx];
+}
+
+void USBpackets::release(uint8_t* packet) {
+    uint8_t idx = poolIndex(packet);
+    if ((idx >= USB_PACKET_POOL_SIZE) || (state[idx] != PACKET_OWNED)) {
+        return;
+    }
+
+    {
+        DeferredSection section;
+        giveBuffer(idx);
+    }
+
+    // receiving may have stopped for lack of buffers
+    startReceive();
+}
+
+uint8_t USBpackets::freePackets() {
+    uint32_t mask = freeMask;
+    uint8_t count = 0;
+    for (; mask; mask &= (mask - 1)) {
+        count++;
+    }
+    return count;
+}
+
+uint8_t USBpackets::poolIndex(uint8_t* packet) {
+    uint32_t offset = packet - pool[0];
+    if ((packet < pool[0]) || (offset % USB_PACKET_SIZE)) {
+        return USB_PACKET_POOL_SIZE;
+    }
+    offset /= USB_PACKET_SIZE;
+    return (offset < USB_PACKET_POOL_SIZE) ? offset : USB_PACKET_POOL_SIZE;
+}
+
+uint8_t* USBpackets::takeBuffer(uint8_t new_state) {
+    uint32_t mask = freeMask;
+    if (!mask) {
+        return NULL;
+    }
+
+    uint8_t idx = 0;
+    while (!(mask & (1UL << idx))) {
+        idx++;
+    }
+    freeMask = mask & ~(1UL << idx);
+    state[idx] = new_state;
+    return pool[idx];
+}
+void USBpackets::giveBuffer(uint8_t idx) {
+    state[idx] = PACKET_FREE;
+    freeMask |= (1UL << idx);
+}
+
+void USBpackets::startTransmit() {
+    if (!transmitDMAInProgress) {
+        DeferredSection section;
+        // if no running tx transfer start one
+        if (!transmitDMAInProgress) {
+            usbserial_run_tx_callback(0);
+        }
+    }
+}
+void USBpackets::startReceive() {
+    if (!receiveDMAInProgress) {
+        DeferredSection section;
+        // if no running rx transfer start one
+        if (!receiveDMAInProgress) {
+            usbserial_run_rx_callback(0);
+        }
+    }
+}
+
+// received packet available
+bool USBpackets::available() {
+    return (rxTail != rxHead);
+}
+// port open
+bool USBpackets::isOpen() {
+    return DTR();
+}
+
+uint32_t USBpackets::baudrate() {
+    return usbserial_get_baudrate();
+}
+bool USBpackets::DTR() {
+    return usbserial_get_line_info() & CDC_LINESTATE_DTR_MASK;
+}
+
+// Receive DMA callback
+// Called when the USB serial endpoint completes a host to device transfer to queue the filled buffer
+// and give the endpoint another buffer from the pool while under the receive limit.
+HOT_RAMFUNC
+uint8_t* USBpackets::_receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_len) {
+    if (buffer) {
+        uint8_t idx = poolIndex(buffer);
+        rxArmed--;
+        if (len > 0) {
+            length[idx] = len;
+            uint8_t head = rxHead;
+            rxQueue[head & queueMask] = idx;
+            __DMB();
+            rxHead = head + 1;
+        } else {
+            // nothing received so the buffer can go back to the pool
+            giveBuffer(idx);
+        }
+    }
+
+    uint8_t* rx_buf = NULL;
+    if ((uint8_t)(rxHead - rxTail) + rxArmed < USB_PACKET_RX_LIMIT) {
+        rx_buf = takeBuffer(PACKET_RX);
+    }
+    if (rx_buf) {
+        rxArmed++;
+        receiveDMAInProgress = true;
+        *new_len = USB_PACKET_SIZE;
+        return rx_buf;
+    } else {
+        receiveDMAInProgress = false;
+        // inform the handler that another transfer is not required
+        return NULL;
+    }
+}
+
+// Transmit DMA callback
+// Called when the USB serial endpoint completes a device to host transfer to return the sent buffer
+// to the pool and start sending the next submitted packet.
+HOT_RAMFUNC
+uint8_t* USBpackets::_send_data_cb(uint8_t tx_len, uint8_t* new_len) {
+    if (tx_len > 0) {
+        // the oldest packet in flight has been sent
+        giveBuffer(txQueue[txTail & queueMask]);
+        txTail++;
+    }
+
+    uint8_t send = txSendIdx;
+    if (send != txHead) {
+        __DMB();
+        uint8_t idx = txQueue[send & queueMask];
+        txSendIdx = send + 1;
+        transmitDMAInProgress = true;
+        *new_len = length[idx];
+        return pool[idx];
+    } else {
+        transmitDMAInProgress = false;
+        // inform the handler that another transfer is not required
+        return NULL;
+    }
+}
+
+USBpackets usbpackets;
+
+uint8_t* usbpackets_receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_len) {
+    return usbpackets._receive_data_cb(buffer, len, new_len);
+}
+uint8_t* usbpackets_send_data_cb(uint8_t tx_len, uint8_t* new_len) {
+    return usbpackets._send_data_cb(tx_len, new_len);
+}
+
+#endif
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "USB-CDC.h"
+#include "Critical.h"
+
+// Packet mode USB serial, build with -DUSB_SERIAL_PACKET_MODE to use it in place of USBserial.
+// Data is moved as whole packets in buffers borrowed from a fixed pool, so nothing is copied
+// between the application and the USB endpoints.
+
+// max packet size of the CDC data endpoints
+#define USB_PACKET_SIZE 64
+
+#ifndef USB_PACKET_POOL_SIZE
+// number of packet buffers shared by both directions, must be a power of 2 up to 32
+#define USB_PACKET_POOL_SIZE 8
+#endif
+#ifndef USB_PACKET_RX_LIMIT
+// max buffers that received packets can hold, so unread packets can't starve allocate()
+#define USB_PACKET_RX_LIMIT (USB_PACKET_POOL_SIZE / 2)
+#endif
+
+class USBpackets {
+public:
+    USBpackets();
+    void _del();
+
+    // borrow an empty packet buffer, returns NULL if the pool is empty.
+    // The buffer is USB_PACKET_SIZE bytes and 4-byte aligned.
+    uint8_t* allocate();
+    // send len bytes of a buffer from allocate(), it returns to the pool once sent.
+    // Packets are sent in the order they are submitted, a full packet doesn't end a transfer
+    // on the host so finish a message that is a multiple of 64 bytes with a shorter packet.
+    // returns false if the buffer isn't one the caller owns, e.g. already submitted, or len isn't 1-64
+    bool submit(uint8_t* packet, uint8_t len);
+
+    // returns the oldest received packet and its length, NULL if nothing has been received.
+    // The caller owns the buffer until it is passed to release() or submit().
+    uint8_t* receive(uint8_t* len);
+    // return a buffer to the pool without sending it, ignored if the caller doesn't own it
+    void release(uint8_t* packet);
+
+    // number of buffers free in the pool
+    uint8_t freePackets();
+
+    // received packet available
+    bool available();
+    // port open
+    bool isOpen();
+
+    uint32_t baudrate();
+    bool DTR();
+
+    uint8_t* _receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_len);
+    uint8_t* _send_data_cb(uint8_t tx_len, uint8_t* new_len);
+
+private:
+    static_assert((USB_PACKET_POOL_SIZE & (USB_PACKET_POOL_SIZE - 1)) == 0 && USB_PACKET_POOL_SIZE <= 32,
+        "USB_PACKET_POOL_SIZE must be a power of 2 up to 32");
+    static_assert(USB_PACKET_RX_LIMIT >= 1 && USB_PACKET_RX_LIMIT < USB_PACKET_POOL_SIZE,
+        "USB_PACKET_RX_LIMIT must leave buffers for sending");
+    static const uint8_t queueMask = USB_PACKET_POOL_SIZE - 1;
+
+    // Alignment required for DMA from USB
+    __attribute__((__aligned__(4))) uint8_t pool[USB_PACKET_POOL_SIZE][USB_PACKET_SIZE];
+    uint8_t length[USB_PACKET_POOL_SIZE];  // bytes to send or received in each buffer
+    volatile uint32_t freeMask = (USB_PACKET_POOL_SIZE == 32) ? 0xFFFFFFFF : ((1UL << USB_PACKET_POOL_SIZE) - 1);
+    // who has each buffer, so a buffer can't be submitted or released twice or while it is receiving
+    volatile uint8_t state[USB_PACKET_POOL_SIZE] = {0};
+
+    // Queues of pool indices, each buffer can only be queued once so they can't overflow.
+    // Indices are free-running and masked on access.
+    // tx: the main loop submits at the head, the USB interrupt sends from sendIdx and frees from the tail
+    uint8_t txQueue[USB_PACKET_POOL_SIZE];
+    volatile uint8_t txHead = 0;
+    uint8_t txTail = 0;
+    uint8_t txSendIdx = 0;
+    // rx: the USB interrupt adds received packets at the head, the main loop takes them from the tail
+    uint8_t rxQueue[USB_PACKET_POOL_SIZE];
+    volatile uint8_t rxHead = 0;
+    volatile uint8_t rxTail = 0;
+    uint8_t rxArmed = 0;  // buffers given to the OUT endpoint, only used by the USB interrupt
+
+    volatile bool receiveDMAInProgress = false;
+    volatile bool transmitDMAInProgress = false;
+
+    // returns the pool index of a buffer, or USB_PACKET_POOL_SIZE if it isn't one
+    uint8_t poolIndex(uint8_t* packet);
+    // take a free buffer for new_state, the caller must hold off the deferred USB work
+    uint8_t* takeBuffer(uint8_t new_state);
+    void giveBuffer(uint8_t idx);
+
+    // start a transfer if the endpoint is idle
+    void startTransmit();
+    void startReceive();
+};
+
+extern USBpackets usbpackets;
+
+extern "C" {
+    uint8_t* usbpackets_receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_len);
+    uint8_t* usbpackets_send_data_cb(uint8_t tx_len, uint8_t* new_len);
+}
@@ -1,10 +1,11 @@
 #include "USBserial.h"
 
-#ifndef USB_RESET_ONLY
+#if !defined(USB_RESET_ONLY) && !defined(USB_SERIAL_PACKET_MODE)
 
 USBserial::USBserial() {
     usbserial_set_tx_callback(usbserial_send_data_cb);
     usbserial_set_rx_callback(usbserial_receive_data_cb);
+    usbserial_set_tick_callback(usbserial_tick_cb);
 }
 /// Having a destructor adds ~400 bytes to the BSS section,
 /// since this is defined globally this is not really needed
@@ -15,50 +16,206 @@ void USBserial::_del() {
     // remove callbacks
     usbserial_set_tx_callback(NULL);
     usbserial_set_rx_callback(NULL);
+    usbserial_set_tick_callback(NULL);
 }
 
 
-uint8_t USBserial::write(const char* data, uint8_t len) {
-    pauseInterrupts();
-    uint8_t len_stored = tx_buffer.store(data, len);
-    // if no running tx transfer start one
-    if (!transmitDMAInProgress) {
-        usbserial_run_tx_callback(0);
-    }
-    resumeInterrupts();
+uint16_t USBserial::write(const char* data, uint16_t len) {
+    // the buffer's length type can be 8-bit, it can't take more than that in one go anyway
+    uint16_t len_stored = tx_buffer.store(data, min(len, (tx_buffer_t::len_t)~0));
+    startTransmit();
     return len_stored;
 }
 uint8_t USBserial::write(uint8_t c) {
-    pauseInterrupts();
     uint8_t len = tx_buffer.store(c);
-    // if no running tx transfer start one
-    if (!transmitDMAInProgress) {
-        usbserial_run_tx_callback(0);
-    }
-    resumeInterrupts();
+    startTransmit();
     return len;
 }
 
-uint8_t USBserial::read(char* buffer, uint8_t max_len) {
-    pauseInterrupts();
-    uint8_t len = rx_buffer.read((uint8_t*)buffer, max_len);
-    // if no running rx transfer start one
-    if (!receiveDMAInProgress) {
-        usbserial_run_rx_callback(0);
-    }
-    resumeInterrupts();
+uint16_t USBserial::read(char* buffer, uint16_t max_len) {
+    uint16_t len = rx_buffer.read((uint8_t*)buffer, min(max_len, (rx_buffer_t::len_t)~0));
+    startReceive();
     return len;
 }
 
 uint8_t USBserial::read_char() {
-    pauseInterrupts();
     uint8_t len = rx_buffer.read_char();
-    // if no running rx transfer start one
+    startReceive();
+    return len;
+}
+
+uint16_t USBserial::write_all(const char* data, uint16_t len, uint32_t timeout_ms) {
+    uint32_t start = millis();
+    uint16_t len_stored = 0;
+
+    while (true) {
+        len_stored += write(data + len_stored, len - len_stored);
+        if ((len_stored >= len) || !waitForSpace(start, timeout_ms)) {
+            return len_stored;
+        }
+    }
+}
+
+uint16_t USBserial::read_exact(char* buffer, uint16_t len, uint32_t timeout_ms) {
+    uint32_t start = millis();
+    uint16_t len_read = 0;
+
+    while (true) {
+        len_read += read(buffer + len_read, len - len_read);
+        if ((len_read >= len) || !waitForData(start, timeout_ms)) {
+            return len_read;
+        }
+    }
+}
+
+uint16_t USBserial::read_until(char* buffer, uint16_t max_len, char delimiter, uint32_t timeout_ms) {
+    uint32_t start = millis();
+    uint16_t len_read = 0;
+
+    while (len_read < max_len) {
+        if (rx_buffer.isEmpty()) {
+            if (!waitForData(start, timeout_ms)) {
+                break;
+            }
+            continue;
+        }
+        // take everything received so far
+        while ((len_read < max_len) && !rx_buffer.isEmpty()) {
+            char c = rx_buffer.read_char();
+            buffer[len_read++] = c;
+            if (c == delimiter) {
+                startReceive();
+                return len_read;
+            }
+        }
+        startReceive();
+    }
+    return len_read;
+}
+
+// Checking the buffer with interrupts disabled means an interrupt that changes it can't be missed,
+// the wait also ends at the timeout so it is checked even without USB traffic.
+bool USBserial::waitForSpace(uint32_t start, uint32_t timeout_ms) {
+    {
+        CriticalSection section;
+        if (tx_buffer.isFull()) {
+            waitForInterrupt(start, timeout_ms);
+        }
+    }
+    return !(timeout_ms && ((millis() - start) >= timeout_ms));
+}
+bool USBserial::waitForData(uint32_t start, uint32_t timeout_ms) {
+    {
+        CriticalSection section;
+        if (rx_buffer.isEmpty()) {
+            waitForInterrupt(start, timeout_ms);
+        }
+    }
+    return !(timeout_ms && ((millis() - start) >= timeout_ms));
+}
+
+void USBserial::setTxCoalescing(uint8_t timeout_ms) {
+    txCoalesceTimeout = timeout_ms;
+    if (!timeout_ms) {
+        // send anything that was being held
+        flush();
+    }
+}
+void USBserial::flush() {
+    txFlushPending = true;
+    startTransmit();
+}
+
+bool USBserial::holdTransmit() {
+    if (!txCoalesceTimeout || txFlushPending) {
+        return false;
+    }
+    // data already in flight doesn't count towards the next packet
+    if ((tx_buffer.unsentSpace() >= USB_SERIAL_PACKET_SIZE) || tx_buffer.isFull()) {
+        return false;
+    }
+    // start the timeout from the first byte held
+    if (!txFlushTicks) {
+        txFlushTicks = txCoalesceTimeout;
+        requestTicks();
+    }
+    return true;
+}
+
+uint16_t USBserial::peek(RingBufferSpan regions[2]) {
+    return rx_buffer.peek(regions);
+}
+void USBserial::consume(uint16_t len) {
+    rx_buffer.consume(len);
+    startReceive();
+}
+
+uint16_t USBserial::reserve(RingBufferSpan regions[2]) {
+    return tx_buffer.reserve(regions);
+}
+void USBserial::commit(uint16_t len) {
+    tx_buffer.commit(len);
+    startTransmit();
+}
+
+// The buffers are lock-free so only starting a transfer needs the deferred work held off,
+// the USB interrupt itself only queues the completion work so is left running.
+// While a transfer is running the completion interrupt picks up any new data/space,
+// the flag is only cleared after the interrupt has seen the buffer empty/full
+// so checking it after updating the buffer can't miss a transfer.
+void USBserial::startTransmit() {
+    if (!transmitDMAInProgress) {
+        if (holdTransmit()) {
+            // the tick callback will send the data if the packet doesn't fill in time
+            return;
+        }
+        DeferredSection section;
+        // if no running tx transfer start one
+        if (!transmitDMAInProgress) {
+            usbserial_run_tx_callback(0);
+        }
+    }
+}
+void USBserial::startReceive() {
     if (!receiveDMAInProgress) {
-        usbserial_run_rx_callback(0);
+        DeferredSection section;
+        // if no running rx transfer start one
+        if (!receiveDMAInProgress) {
+            usbserial_run_rx_callback(0);
+        }
     }
-    resumeInterrupts();
-    return len;
+}
+
+void USBserial::onReceive(usbserial_event_handler_t handler, uint16_t threshold, int16_t delimiter, uint8_t idle_ms) {
+    DeferredSection section;
+    rxHandler = handler;
+    rxThreshold = threshold;
+    rxDelimiter = delimiter;
+    rxIdleTimeout = idle_ms;
+    rxIdleTicks = 0;
+    rxEvents = 0;
+}
+
+// only called from the deferred work, so handleEvents() can't be part way through taking the events
+void USBserial::raiseEvents(uint8_t events) {
+    rxEvents |= events;
+}
+
+bool USBserial::handleEvents() {
+    uint8_t events;
+    usbserial_event_handler_t handler;
+    {
+        DeferredSection section;
+        events = rxEvents;
+        rxEvents = 0;
+        handler = rxHandler;
+    }
+
+    if (!events || !handler) {
+        return false;
+    }
+    handler(events);
+    return true;
 }
 
 bool USBserial::writeBufFull() {
@@ -87,14 +244,36 @@ bool USBserial::DTR() {
 // Receive buffer DMA callback
 // Called when the USB serial endpoint completes a host to device transfer to inform the ring buffer
 // of the new data and optionally trigger another transfer while there is space in the buffer.
+HOT_RAMFUNC
 uint8_t* USBserial::_receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_len) {
-    if (len > 0) {
+    if (buffer) {
         // update the headPtr to reflect the data added by this DMA
         rx_buffer.completeDirectWrite(len);
+
+        if (rxHandler && len) {
+            uint8_t events = 0;
+            if (rxThreshold && (rx_buffer.usedSpace() >= rxThreshold)) {
+                events |= USB_SERIAL_EVENT_THRESHOLD;
+            }
+            if ((rxDelimiter >= 0) && memchr(buffer, rxDelimiter, len)) {
+                events |= USB_SERIAL_EVENT_DELIMITER;
+            }
+            if (events) {
+                raiseEvents(events);
+            }
+            // restart the idle timeout from this packet
+            rxIdleTicks = rxIdleTimeout;
+            if (rxIdleTicks) {
+                requestTicks();
+            }
+        }
     }
-    if (!rx_buffer.isFull()) { // while there's space in the buffer trigger another transfer
+    rx_buffer_t::len_t rx_len;
+    uint8_t* rx_head = rx_buffer.prepareDirectWrite(&rx_len);
+    if (rx_head) { // while there's space in the buffer trigger another transfer
         receiveDMAInProgress = true;
-        return rx_buffer.prepareDirectWrite(new_len);
+        *new_len = min(rx_len, USB_SERIAL_PACKET_SIZE);
+        return rx_head;
     } else {
         receiveDMAInProgress = false;
         // inform the handler that another transfer is not required
@@ -105,13 +284,29 @@ uint8_t* USBserial::_receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_
 // Transmit buffer DMA callback
 // Called when the USB serial endpoint completes a device to host transfer to inform the ring buffer
 // of the data that has been sent and optionally trigger another transfer while the buffer still contains data.
+HOT_RAMFUNC
 uint8_t* USBserial::_send_data_cb(uint8_t tx_len, uint8_t* new_len) {
     if (tx_len > 0) {
         // update the tailPtr to reflect the data sent by this DMA
         tx_buffer.completeDirectRead(tx_len);
     }
-    if (!tx_buffer.isEmpty()) { // while the buffer still contains data trigger another transfer
-        uint8_t* tx_head = tx_buffer.prepareDirectRead(new_len);
+    if (tx_buffer.isEmpty()) {
+        // everything has been sent, stop any flush
+        txFlushPending = false;
+        txFlushTicks = 0;
+    }
+    if (tx_buffer.unsentSpace() && !holdTransmit()) { // while the buffer still contains data trigger another transfer
+        tx_buffer_t::len_t send_len;
+        uint8_t* tx_head;
+        if (txCoalesceTimeout) {
+            // the ring wrap and alignment would split a packet into several transfers
+            tx_head = txPackets[txPacketIdx];
+            send_len = tx_buffer.prepareCopyRead(tx_head, USB_SERIAL_PACKET_SIZE);
+            txPacketIdx = (txPacketIdx + 1) % USB_SERIAL_TX_PACKETS;
+        } else {
+            tx_head = tx_buffer.prepareDirectRead(&send_len, USB_SERIAL_PACKET_SIZE);
+        }
+        *new_len = send_len;
         if (*new_len) {
             transmitDMAInProgress = true;
             return tx_head;
@@ -127,6 +322,21 @@ uint8_t* USBserial::_send_data_cb(uint8_t tx_len, uint8_t* new_len) {
     }
 }
 
+// Tick callback
+// Called from SysTick each ms to send held data once the coalescing timeout has passed.
+void USBserial::_tick_cb() {
+    if (txFlushTicks && !(--txFlushTicks)) {
+        flush();
+    }
+    if (rxIdleTicks && !(--rxIdleTicks)) {
+        raiseEvents(USB_SERIAL_EVENT_IDLE);
+    }
+    if (txFlushTicks || rxIdleTicks) {
+        // still counting down
+        requestTicks();
+    }
+}
+
 USBserial usbserial;
 
 uint8_t* usbserial_receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_len) {
@@ -135,5 +345,8 @@ uint8_t* usbserial_receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_le
 uint8_t* usbserial_send_data_cb(uint8_t tx_len, uint8_t* new_len) {
     return usbserial._send_data_cb(tx_len, new_len);
 }
+void usbserial_tick_cb() {
+    usbserial._tick_cb();
+}
 
 #endif
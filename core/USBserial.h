@@ -2,9 +2,48 @@
 
 #include <stdint.h>
 #include "RingBuffer.h"
+#include "PacketRingBuffer.h"
+#include "Critical.h"
 #include "USB-CDC.h"
 
+// max packet size of the CDC data endpoints, each transfer is limited to a single packet
+#define USB_SERIAL_PACKET_SIZE 64
+
+// buffer sizes can be overridden per build, e.g. -DUSB_SERIAL_RX_BUFFER_LENGTH=512
+#ifndef USB_SERIAL_BUFFER_LENGTH
 #define USB_SERIAL_BUFFER_LENGTH 64
+#endif
+#ifndef USB_SERIAL_TX_COALESCE_MS
+// default time to hold a partial packet before sending it, 0 sends every write immediately
+#define USB_SERIAL_TX_COALESCE_MS 0
+#endif
+#ifndef USB_SERIAL_TX_BUFFER_LENGTH
+#if USB_SERIAL_TX_COALESCE_MS
+// one packet can fill while the last is sent
+#define USB_SERIAL_TX_BUFFER_LENGTH (2 * USB_SERIAL_PACKET_SIZE)
+#else
+#define USB_SERIAL_TX_BUFFER_LENGTH USB_SERIAL_BUFFER_LENGTH
+#endif
+#endif
+#if USB_SERIAL_TX_COALESCE_MS && (USB_SERIAL_TX_BUFFER_LENGTH < (2 * USB_SERIAL_PACKET_SIZE))
+#error "coalescing writes needs a USB_SERIAL_TX_BUFFER_LENGTH of at least 2 packets, or writers stall while a packet fills"
+#endif
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+#define USB_SERIAL_TX_PACKETS 2  // one per bank
+#else
+#define USB_SERIAL_TX_PACKETS 1
+#endif
+#ifndef USB_SERIAL_RX_BUFFER_LENGTH
+// the receive buffer is stored as whole packets, with 2 one can be read while the next is received
+#define USB_SERIAL_RX_BUFFER_LENGTH (2 * USB_SERIAL_PACKET_SIZE)
+#endif
+
+// receive events, passed to the handler set with USBserial::onReceive
+#define USB_SERIAL_EVENT_THRESHOLD 0x1  // at least threshold bytes are waiting to be read
+#define USB_SERIAL_EVENT_DELIMITER 0x2  // the delimiter was received
+#define USB_SERIAL_EVENT_IDLE      0x4  // nothing has been received for idle_ms since the last packet
+
+typedef void (*usbserial_event_handler_t)(uint8_t events);
 
 class USBserial {
 public:
@@ -13,15 +52,55 @@ public:
     void _del();
 
     // returns bytes added to buffer
-    uint8_t write(const char* data, uint8_t len);
+    uint16_t write(const char* data, uint16_t len);
     uint8_t write(uint8_t c);
 
     // returns bytes retrieved
-    uint8_t read(char* buffer, uint8_t max_len);
+    uint16_t read(char* buffer, uint16_t max_len);
 
     // returns character
     uint8_t read_char();
 
+    /// Blocking versions, these sleep until the USB interrupts free space or receive data.
+    /// They wait up to timeout_ms in total, 0 waits forever.
+    /// Must not be called from an interrupt or with interrupts disabled.
+    // returns bytes written, less than len only on timeout
+    uint16_t write_all(const char* data, uint16_t len, uint32_t timeout_ms=0);
+    // returns bytes read, less than len only on timeout
+    uint16_t read_exact(char* buffer, uint16_t len, uint32_t timeout_ms=0);
+    // reads up to and including delimiter, returns bytes read.
+    // Stops early once max_len bytes are read or on timeout.
+    uint16_t read_until(char* buffer, uint16_t max_len, char delimiter, uint32_t timeout_ms=0);
+
+    // Hold written data until a full packet is buffered or timeout_ms has passed since the
+    // first held byte, so small writes share packets. 0 sends every write immediately.
+    // Each packet is sent whole from a copy, the transmit buffer should hold at least 2 packets
+    // so writes can continue while one is sent.
+    void setTxCoalescing(uint8_t timeout_ms);
+    // send any held data without waiting for the timeout
+    void flush();
+
+    /// Zero-copy access to the buffers, see RingBuffer::peek/reserve.
+    /// regions[1] is only used when the data wraps around the end of the buffer.
+    // fills regions with the next two received packets and returns their total length
+    uint16_t peek(RingBufferSpan regions[2]);
+    // release len bytes of received data
+    void consume(uint16_t len);
+    // fills regions with the free transmit space and returns the total length
+    uint16_t reserve(RingBufferSpan regions[2]);
+    // send len bytes written to the reserved space
+    void commit(uint16_t len);
+
+    // Call handler with the events that occurred when data is received.
+    // The events are collected by the USB deferred work and the handler is run by handleEvents() from thread
+    // mode, so it can take as long as it likes without holding up transfers or other interrupts.
+    // A threshold of 0, delimiter of -1 or idle_ms of 0 disables that event, a NULL handler disables them all.
+    void onReceive(usbserial_event_handler_t handler, uint16_t threshold=0, int16_t delimiter=-1, uint8_t idle_ms=0);
+    // Run the handler with the events raised since it last ran, call it from the main loop.
+    // Returns true if it ran, so a task can hand events over with ASYNC_AWAIT(usbserial.handleEvents()).
+    // Events are raised by deferred work, which also wakes async_run() from its sleep.
+    bool handleEvents();
+
     bool writeBufFull();
     bool readBufFull();
 
@@ -35,16 +114,46 @@ public:
 
     uint8_t* _receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_len);
     uint8_t* _send_data_cb(uint8_t tx_len, uint8_t* new_len);
+    void _tick_cb();
 
 private:
-    RingBuffer<USB_SERIAL_BUFFER_LENGTH, BUFFER_USB_TX_ALIGN> tx_buffer;
-    RingBuffer<USB_SERIAL_BUFFER_LENGTH, BUFFER_USB_RX_ALIGN> rx_buffer;
-    bool receiveDMAInProgress = false;
-    bool transmitDMAInProgress = false;
-
-    uint8_t __irq_status = 0;
-    inline void pauseInterrupts() {__irq_status=__get_PRIMASK(); __disable_irq();}
-    inline void resumeInterrupts() {if(!__irq_status){__enable_irq();}}
+    // the main loop is the only producer of tx_buffer and the only consumer of rx_buffer,
+    // the USB interrupt is the other side of each
+    typedef RingBuffer<USB_SERIAL_TX_BUFFER_LENGTH, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE> tx_buffer_t;
+    typedef PacketRingBuffer<USB_SERIAL_RX_BUFFER_LENGTH, USB_SERIAL_PACKET_SIZE> rx_buffer_t;
+    tx_buffer_t tx_buffer;
+    rx_buffer_t rx_buffer;
+    volatile bool receiveDMAInProgress = false;
+    volatile bool transmitDMAInProgress = false;
+
+    uint8_t txCoalesceTimeout = USB_SERIAL_TX_COALESCE_MS;
+    volatile uint8_t txFlushTicks = 0;  // ms until held data is sent, 0 when not counting
+    volatile bool txFlushPending = false;  // send everything up to the end of the buffer
+    // coalesced packets are copied out of tx_buffer so each is a single aligned transfer
+    __attribute__((__aligned__(4))) uint8_t txPackets[USB_SERIAL_TX_PACKETS][USB_SERIAL_PACKET_SIZE];
+    uint8_t txPacketIdx = 0;  // next of txPackets to fill
+
+    usbserial_event_handler_t rxHandler = NULL;
+    uint16_t rxThreshold = 0;
+    int16_t rxDelimiter = -1;
+    uint8_t rxIdleTimeout = 0;
+    volatile uint8_t rxIdleTicks = 0;  // ms until the idle event, 0 when not counting
+    volatile uint8_t rxEvents = 0;  // events waiting for the handler
+
+    // queue events for the handler
+    void raiseEvents(uint8_t events);
+
+    // returns true if a partial packet should be held back, starting the flush timeout
+    bool holdTransmit();
+
+    // start a transfer if the endpoint is idle
+    void startTransmit();
+    void startReceive();
+
+    // sleep until the next interrupt if the buffer is still full/empty,
+    // returns false once timeout_ms has passed since start
+    bool waitForSpace(uint32_t start, uint32_t timeout_ms);
+    bool waitForData(uint32_t start, uint32_t timeout_ms);
 };
 
 extern USBserial usbserial;
@@ -52,4 +161,5 @@ extern USBserial usbserial;
 extern "C" {
     uint8_t* usbserial_receive_data_cb(uint8_t* buffer, uint8_t len, uint8_t* new_len);
     uint8_t* usbserial_send_data_cb(uint8_t tx_len, uint8_t* new_len);
+    void usbserial_tick_cb();
 }
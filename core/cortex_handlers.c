@@ -21,6 +21,7 @@
 #include <stdio.h>
 
 #include "generic.h"
+#include "Deferred.h"
 
 /* Default empty handler */
 void Dummy_Handler(void)
@@ -36,7 +37,7 @@ void HardFault_Handler(void) __attribute__ ((weak, alias("Dummy_Handler")));
 void Reset_Handler    (void);
 void NMI_Handler      (void) __attribute__ ((weak, alias("Dummy_Handler")));
 void SVC_Handler      (void) __attribute__ ((weak, alias("Dummy_Handler")));
-void PendSV_Handler   (void) __attribute__ ((weak, alias("Dummy_Handler")));
+void PendSV_Handler   (void);
 void SysTick_Handler  (void);
 
 /* Peripherals handlers */
@@ -131,50 +132,124 @@ __attribute__ ((section(".isr_vector"))) const DeviceVectors exception_table =
   (void*) (0UL),                  /* Reserved */
 };
 
+#ifdef RAM_VECTORS
+/* Copy of the exception table that setIsr writes to, VTOR needs it 256 byte aligned (45 vectors
+   rounded up to a power of 2). Reset_Handler fills it so it is left out of .data and .bss,
+   the linker scripts put it first at the start of RAM where it needs no padding */
+__attribute__ ((section(".noinit.vectors"), aligned(256))) static DeviceVectors ram_exception_table;
+
+void setIsr(IRQn_Type irq, void (*isr)(void))
+{
+  /* the stack pointer and 15 core exceptions come before IRQ 0, core exceptions are negative */
+  void **vectors = (void **)&ram_exception_table;
+  void * const *defaults = (void * const *)&exception_table;
+  vectors[irq + 16] = isr ? (void *)isr : defaults[irq + 16];
+  __DSB();
+}
+#endif
+
+/* Deferred work, runs at the lowest priority after the interrupts that requested it */
+HOT_RAMFUNC
+void PendSV_Handler(void)
+{
+  deferred_run();
+}
+
 extern int main(void);
 void __libc_init_array(void);
 
+/* Copy 16 bytes per LDM/STM pair then any remaining words, the sections are word aligned */
+static inline void initCopy(uint32_t *pDest, const uint32_t *pSrc, const uint32_t *pEnd)
+{
+  while ((pEnd - pDest) >= 4) {
+    __asm__ __volatile__ (
+      "ldmia %[src]!, {r3, r4, r5, r6}\n\t"
+      "stmia %[dst]!, {r3, r4, r5, r6}\n\t"
+      : [src] "+l" (pSrc), [dst] "+l" (pDest)
+      :
+      : "r3", "r4", "r5", "r6", "memory"
+    );
+  }
+  while (pDest < pEnd)
+    *pDest++ = *pSrc++;
+}
+
+/* Clear 16 bytes per STM then any remaining words */
+static inline void initZero(uint32_t *pDest, const uint32_t *pEnd)
+{
+  register uint32_t zero asm("r3") = 0;
+  register uint32_t zero1 asm("r4") = 0;
+  register uint32_t zero2 asm("r5") = 0;
+  register uint32_t zero3 asm("r6") = 0;
+  while ((pEnd - pDest) >= 4) {
+    __asm__ __volatile__ (
+      "stmia %[dst]!, {r3, r4, r5, r6}\n\t"
+      : [dst] "+l" (pDest)
+      : "r" (zero), "r" (zero1), "r" (zero2), "r" (zero3)
+      : "memory"
+    );
+  }
+  while (pDest < pEnd)
+    *pDest++ = 0;
+}
+
 /* This is called on processor reset to initialize the device and call main() */
 void Reset_Handler(void)
 {
-  uint32_t *pSrc, *pDest;
+  /* Free-run SysTick at the reset clock to time the boot until SystemStart configures it */
+  SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
 
-  /* Initialize the initialized data section */
-  pSrc = &__etext;
-  pDest = &__data_start__;
+  /* Switch to 48MHz first so everything after runs at full speed, SystemInit doesn't use .data or .bss */
+  SystemInit();
 
-  if ((&__data_start__ != &__data_end__) && (pSrc != pDest)) {
-    for (; pDest < &__data_end__; pDest++, pSrc++)
-      *pDest = *pSrc;
-  }
+  /* Initialize the initialized data section */
+  if (&__data_start__ != &__etext)
+    initCopy(&__data_start__, &__etext, &__data_end__);
 
   /* Clear the zero section */
-  if ((&__data_start__ != &__data_end__) && (pSrc != pDest)) {
-    for (pDest = &__bss_start__; pDest < &__bss_end__; pDest++)
-      *pDest = 0;
-  }
+  initZero(&__bss_start__, &__bss_end__);
 
-  /* Initialize the C library */
-  __libc_init_array();
+#ifdef RAM_VECTORS
+  /* Take interrupts from the RAM table, nothing is enabled yet */
+  initCopy((uint32_t *)&ram_exception_table, (const uint32_t *)&exception_table, (uint32_t *)(&ram_exception_table + 1));
+  SCB->VTOR = (uint32_t)&ram_exception_table;
+  __DSB();
+#endif
 
-  SystemInit();
-  // init();  // now included in SystemInit()
+  /* SysTick, USB and anything else using RAM */
+  SystemStart();
+
+  /* Initialize the C library, static constructors run at 48MHz */
+  __libc_init_array();
 
+  bootReachedMain();
   main();
 
   while (1)
     ;
 }
 
+#ifndef RAM_VECTORS
 static void (*usb_isr)(void) = NULL;
+#endif
 
+HOT_RAMFUNC
 void USB_Handler(void)
 {
+#ifndef RAM_VECTORS
   if (usb_isr)
     usb_isr();
+#endif
 }
 
 void USB_SetHandler(void (*new_usb_isr)(void))
 {
+#ifdef RAM_VECTORS
+  /* the USB vector goes straight to the handler, NULL puts back USB_Handler which does nothing */
+  setIsr(USB_IRQn, new_usb_isr);
+#else
   usb_isr = new_usb_isr;
+#endif
 }
@@ -25,11 +25,67 @@ extern "C" {
 #include <stdint.h>
 #include "generic.h"
 
-/** Tick Counter united by ms */
-static volatile uint32_t _ulTickCount=0 ;
+#include "Timer.h" // for timer_tick()
+#include "USB-CDC.h" // for usbserial_tick()
+
+#ifndef TICKLESS_IDLE
+
+/** Tick Counter united by ms, 64-bit so it never wraps */
+static volatile uint64_t _ulTickCount=0 ;
+/** Cycles at the start of tick _cycleBaseTicks, moved on when a clock change alters the ms length */
+static uint64_t _cycleBase=0 ;
+static uint64_t _cycleBaseTicks=0 ;
 
 unsigned long millis( void ) {
-  return _ulTickCount ;
+  // the low word is a single load so doesn't need interrupts disabled
+  return (uint32_t)_ulTickCount ;
+}
+
+// ms ticks and the SysTick value at the same moment
+static uint64_t readTicks( uint32_t* val ) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint64_t ticks = _ulTickCount;
+  *val = SysTick->VAL;
+  // SysTick reloaded after the handler last ran, VAL is already counting the next ms
+  if ((SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) && (*val > (SysTick->LOAD / 2))) {
+    ticks++;
+  }
+  if (!primask) {
+    __enable_irq();
+  }
+  return ticks;
+}
+
+uint64_t millis64( void ) {
+  uint32_t val;
+  return readTicks(&val);
+}
+
+unsigned long micros( void ) {
+  uint32_t val;
+  uint32_t ticks = (uint32_t)readTicks(&val);
+  return ticks * 1000 + (SysTick->LOAD - val) / (SystemCoreClock / 1000000);
+}
+
+uint64_t cycles64( void ) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t val;
+  uint64_t ticks = readTicks(&val);
+  // each ms since the last clock change is LOAD + 1 cycles
+  uint64_t cycles = _cycleBase + (ticks - _cycleBaseTicks) * (SysTick->LOAD + 1) + (SysTick->LOAD - val);
+  if (!primask) {
+    __enable_irq();
+  }
+  return cycles;
+}
+
+// SysTick wakes the core every ms so the caller checks the timeout at least that often
+void waitForInterrupt( uint32_t start, uint32_t timeout_ms ) {
+  (void)start;
+  (void)timeout_ms;
+  __WFI();
 }
 
 void delay( unsigned long ms ) {
@@ -51,12 +107,282 @@ void delay( unsigned long ms ) {
   }
 }
 
-#include "Reset.h" // for tickReset()
+// Called with interrupts disabled, the new reload is used from the next ms.
+// Once SysTick reaches 0 the clock is switched while it reloads, before much of the ms has passed.
+void prepareTickClock( uint32_t hz ) {
+  uint32_t oldLoad = SysTick->LOAD;
+  SysTick->LOAD = (hz / 1000) - 1;
+  // reading clears COUNTFLAG, it is set again when the count reaches 0
+  (void)SysTick->CTRL;
+  while (!(SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk));
+  // the ms that just ended was the last at the old length, its tick is pending and counted once enabled
+  uint64_t ticks = _ulTickCount + 1;
+  _cycleBase += (ticks - _cycleBaseTicks) * (oldLoad + 1);
+  _cycleBaseTicks = ticks;
+}
 
+HOT_RAMFUNC
 void SysTick_Handler(void) {
   // Increment tick count each ms
   _ulTickCount++;
-  tickReset();
+  timer_tick();
+  usbserial_tick();
+}
+
+#else // TICKLESS_IDLE
+
+/*
+ * The RTC counts the 32.768kHz Generic Clock Generator 1 and only interrupts when something is due,
+ * either the end of a delay() or the next ms tick while one has been requested.
+ * Time is kept as a 64-bit count of 32kHz periods, millis() is derived from it so stays accurate
+ * however long the core sleeps.
+ */
+#define RTC_FREQ_SHIFT 15  // 32768Hz
+
+/** Number of times the 32-bit RTC count has overflowed */
+static volatile uint32_t _rtcOverflows = 0;
+
+static volatile bool _ticksRequested = false;
+static volatile bool _inTicks = false;
+static volatile uint32_t _nextTickMs = 0;
+static volatile bool _delayActive = false;
+static volatile uint32_t _delayEndMs = 0;
+static volatile bool _wakeupRequested = false;
+static volatile uint32_t _wakeupMs = 0;
+/** Cycles at RTC count _cycleBaseCount, moved on when the core clock changes */
+static uint64_t _cycleBase = 0;
+static uint64_t _cycleBaseCount = 0;
+
+// 64-bit count of RTC periods, must be called with interrupts disabled
+static uint64_t rtcCount( void ) {
+  uint32_t high = _rtcOverflows;
+  uint32_t count = RTC->MODE0.COUNT.reg;
+  // an overflow that hasn't been handled yet
+  if (RTC->MODE0.INTFLAG.bit.OVF && (count < 0x80000000)) {
+    high++;
+  }
+  return ((uint64_t)high << 32) | count;
+}
+
+// count * hz / 32768, the whole seconds are scaled separately so it can't overflow
+static inline uint64_t countToHz( uint64_t count, uint32_t hz ) {
+  return (count >> RTC_FREQ_SHIFT) * hz + (((count & ((1 << RTC_FREQ_SHIFT) - 1)) * hz) >> RTC_FREQ_SHIFT);
+}
+
+static inline uint64_t countToMs( uint64_t count ) {
+  return countToHz(count, 1000);
+}
+
+static uint64_t readCount( void ) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint64_t count = rtcCount();
+  if (!primask) {
+    __enable_irq();
+  }
+  return count;
+}
+
+unsigned long millis( void ) {
+  return (uint32_t)countToMs(readCount());
+}
+
+// the RTC period limits these to ~30us resolution
+uint64_t millis64( void ) {
+  return countToMs(readCount());
+}
+
+unsigned long micros( void ) {
+  return (uint32_t)countToHz(readCount(), 1000000);
+}
+
+uint64_t cycles64( void ) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint64_t cycles = _cycleBase + countToHz(rtcCount() - _cycleBaseCount, SystemCoreClock);
+  if (!primask) {
+    __enable_irq();
+  }
+  return cycles;
+}
+
+// Set the compare to the earliest of the next tick, the timer wakeup and the end of a delay,
+// must be called with interrupts disabled
+static void scheduleWakeup( void ) {
+  if (!_ticksRequested && !_delayActive && !_wakeupRequested) {
+    return;
+  }
+
+  uint64_t now = rtcCount();
+  uint64_t nowMs = countToMs(now);
+  int32_t wait = INT32_MAX;
+  if (_ticksRequested) {
+    wait = (int32_t)(_nextTickMs - (uint32_t)nowMs);
+  }
+  if (_delayActive && ((int32_t)(_delayEndMs - (uint32_t)nowMs) < wait)) {
+    wait = (int32_t)(_delayEndMs - (uint32_t)nowMs);
+  }
+  if (_wakeupRequested && ((int32_t)(_wakeupMs - (uint32_t)nowMs) < wait)) {
+    wait = (int32_t)(_wakeupMs - (uint32_t)nowMs);
+  }
+
+  if (wait <= 0) {
+    // already due
+    NVIC_SetPendingIRQ(RTC_IRQn);
+    return;
+  }
+
+  // first count in the target ms
+  uint64_t target = (((nowMs + wait) << RTC_FREQ_SHIFT) + 999) / 1000;
+  RTC->MODE0.COMP[0].reg = (uint32_t)target;
+  while (RTC->MODE0.STATUS.bit.SYNCBUSY);
+  if (rtcCount() >= target) {
+    // the count passed the target while the compare was synchronising
+    NVIC_SetPendingIRQ(RTC_IRQn);
+  }
+}
+
+void requestTicks( void ) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (!_ticksRequested) {
+    _ticksRequested = true;
+    if (!_inTicks) {
+      // the first tick is 1ms from now, while ticking each one follows the last
+      _nextTickMs = millis() + 1;
+      scheduleWakeup();
+    }
+  }
+  if (!primask) {
+    __enable_irq();
+  }
+}
+
+void requestWakeup( uint32_t ms ) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (!_wakeupRequested || ((int32_t)(ms - _wakeupMs) < 0)) {
+    _wakeupRequested = true;
+    _wakeupMs = ms;
+    scheduleWakeup();
+  }
+  if (!primask) {
+    __enable_irq();
+  }
+}
+
+// Nothing wakes the core periodically, so the RTC compare is set for the end of the timeout
+void waitForInterrupt( uint32_t start, uint32_t timeout_ms ) {
+  if (timeout_ms) {
+    // set each time since a delay in an interrupt could have replaced it
+    _delayEndMs = start + timeout_ms;
+    _delayActive = true;
+    scheduleWakeup();
+  }
+  // the compare or any other interrupt wakes the core, it runs once interrupts are enabled
+  __WFI();
+  // once passed the end would keep the RTC interrupt pending
+  _delayActive = false;
+}
+
+void delay( unsigned long ms ) {
+  if (ms == 0) {
+    return;
+  }
+
+  uint32_t start = millis();
+
+  while ((int32_t)((start + ms) - millis()) > 0) {
+    __disable_irq();
+    waitForInterrupt(start, ms);
+    __enable_irq();
+  }
+}
+
+void initTicks( void ) {
+  PM->APBAMASK.reg |= PM_APBAMASK_RTC;
+
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID( RTC_GCLK_ID ) | // Generic Clock Multiplexer 4
+                      GCLK_CLKCTRL_GEN_GCLK1 | // Generic Clock Generator 1 (32kHz) is source
+                      GCLK_CLKCTRL_CLKEN ;
+  while ( GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY );
+
+  RTC->MODE0.CTRL.reg = RTC_MODE0_CTRL_SWRST;
+  while ( RTC->MODE0.CTRL.reg & RTC_MODE0_CTRL_SWRST );
+
+  RTC->MODE0.CTRL.reg = RTC_MODE0_CTRL_MODE_COUNT32 | RTC_MODE0_CTRL_PRESCALER_DIV1;
+  while ( RTC->MODE0.STATUS.bit.SYNCBUSY );
+  // keep COUNT synchronised so it can be read at any time
+  RTC->MODE0.READREQ.reg = RTC_READREQ_RCONT | RTC_READREQ_RREQ;
+
+  RTC->MODE0.INTENSET.reg = RTC_MODE0_INTENSET_OVF | RTC_MODE0_INTENSET_CMP0;
+  NVIC_SetPriority (RTC_IRQn,  (1 << __NVIC_PRIO_BITS) - 2);  /* same priority Systick would have (2nd lowest) */
+  NVIC_EnableIRQ(RTC_IRQn);
+
+  RTC->MODE0.CTRL.bit.ENABLE = 1;
+  while ( RTC->MODE0.STATUS.bit.SYNCBUSY );
+
+  // SysTick free-runs without its interrupt as the cycle counter for delayMicroseconds
+  SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+void prepareTickClock( uint32_t hz ) {
+  // SysTick only counts cycles for delayMicroseconds, which uses SystemCoreClock.
+  // cycles64 counts at the old clock up to here
+  (void)hz;
+  uint64_t count = rtcCount();
+  _cycleBase += countToHz(count - _cycleBaseCount, SystemCoreClock);
+  _cycleBaseCount = count;
+}
+
+HOT_RAMFUNC
+void RTC_Handler(void) {
+  if (RTC->MODE0.INTFLAG.bit.OVF) {
+    RTC->MODE0.INTFLAG.reg = RTC_MODE0_INTFLAG_OVF;
+    _rtcOverflows++;
+  }
+  RTC->MODE0.INTFLAG.reg = RTC_MODE0_INTFLAG_CMP0;
+
+  uint32_t now = millis();
+  if (_wakeupRequested && ((int32_t)(now - _wakeupMs) >= 0)) {
+    _wakeupRequested = false;
+    // catches the timers up to now and requests the wakeup for the next one
+    timer_tick();
+  }
+
+  // run every tick that has passed, users request the next tick while they are still counting
+  _inTicks = true;
+  while (_ticksRequested && ((int32_t)(now - _nextTickMs) >= 0)) {
+    _ticksRequested = false;
+    _nextTickMs++;
+    usbserial_tick();
+  }
+  _inTicks = false;
+
+  __disable_irq();
+  scheduleWakeup();
+  __enable_irq();
+}
+
+#endif // TICKLESS_IDLE
+
+// Counts core clock cycles on SysTick, so the time doesn't depend on flash wait states or
+// how the loop is compiled. Interrupts only add to the delay if they take longer than a SysTick period.
+void delayMicroseconds( unsigned int us ) {
+  // below 1MHz the whole MHz would round to 0
+  uint32_t cycles = (SystemCoreClock >= 1000000) ? (us * (SystemCoreClock / 1000000)) : ((us * (SystemCoreClock / 1000)) / 1000);
+  uint32_t reload = SysTick->LOAD + 1;
+  uint32_t last = SysTick->VAL;
+  uint32_t elapsed = 0;
+
+  while (elapsed < cycles) {
+    uint32_t now = SysTick->VAL;
+    // SysTick counts down and reloads
+    elapsed += (last >= now) ? (last - now) : (last + reload - now);
+    last = now;
+  }
 }
 
 #ifdef __cplusplus
@@ -4,10 +4,32 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
 #include <samd.h>
 
 #define _BV(x) (uint32_t)(1<<x)
 
+// Runs from RAM, so without flash wait states. Copied from flash with .data at startup so it can't be
+// called from SystemInit. long_call as RAM is out of range of a BL from flash.
+#ifdef __arm__
+#define RAMFUNC __attribute__ ((long_call, noinline, section(".ramfunc")))
+#else
+// host builds (make host) have no separate RAM to run from
+#define RAMFUNC __attribute__ ((noinline))
+#endif
+// The interrupt and USB transfer hot paths of the core, built with -DHOT_IN_FLASH they stay in flash
+#ifdef HOT_IN_FLASH
+#define HOT_RAMFUNC
+#else
+#define HOT_RAMFUNC RAMFUNC
+#endif
+// Always inlined, so it runs from RAM inside a HOT_RAMFUNC caller. For the ring buffer DMA helpers,
+// GCC ignores the section attribute on members of class templates so they can't be HOT_RAMFUNC themselves.
+#define HOT_INLINE __attribute__ ((always_inline)) inline
+
+// Not cleared at startup, for large buffers that are always written before they are read
+#define NOINIT __attribute__ ((section(".noinit")))
+
 #define interrupts()    __enable_irq()
 #define noInterrupts()  __disable_irq()
 // This string is in flash and part of the bootloader
@@ -27,6 +49,56 @@ void initDAC( void );
 // delay.c
 unsigned long millis( void );
 void delay( unsigned long ms );
+// 64-bit versions never wrap, cycles64 counts core clock cycles at whatever clock each was run at
+uint64_t millis64( void );
+uint64_t cycles64( void );
+unsigned long micros( void );
+void delayMicroseconds( unsigned int us );
+// Sleep until an interrupt, or until timeout_ms after start (ms from millis()) if timeout_ms isn't 0.
+// Called with interrupts disabled after checking what is being waited for, so an interrupt that
+// changes it can't be missed. It still ends the sleep and runs once interrupts are enabled again.
+// May return early, callers check the timeout themselves.
+void waitForInterrupt( uint32_t start, uint32_t timeout_ms );
+// Set the ms tick for a new core clock frequency, the core clock must be switched straight after.
+// SysTick waits for the start of the next ms so no time is lost, the RTC doesn't depend on the core clock.
+void prepareTickClock( uint32_t hz );
+#ifdef TICKLESS_IDLE
+// The RTC replaces SysTick and ms ticks (usbserial_tick) only run while requested.
+// Anything counting down in ticks must call this when it starts and on each tick it is still counting.
+void requestTicks( void );
+// run timer_tick once millis() reaches ms, or earlier if an earlier wakeup is already requested
+void requestWakeup( uint32_t ms );
+void initTicks( void );
+#else
+// SysTick runs every ms
+static inline void requestTicks( void ) {}
+#endif
+
+// cortex_handlers.c
+#ifdef RAM_VECTORS
+// Built with RAM_VECTORS the exception table is copied to RAM at startup and VTOR pointed at it.
+// Installs isr as the handler of irq (core exceptions included), so the vector calls it directly.
+// NULL puts back the handler the core was linked with. Can be called with the interrupt enabled.
+void setIsr( IRQn_Type irq, void (*isr)(void) );
+#endif
+
+// startup.c
+// Boot times in us from reset, the 1MHz reset clock is counted on SysTick until the switch to 48MHz
+typedef struct {
+  uint32_t clock_us;  // switching the core to 48MHz
+  uint32_t main_us;   // reaching main()
+  uint32_t lock_us;   // the DFLL locking to the crystal, 0 until it has
+} boot_times_t;
+extern boot_times_t bootTimes;
+// clock setup in SystemInit runs before RAM is initialised, SystemStart does the rest
+void SystemStart( void );
+void bootReachedMain( void );
+// Built with FAST_BOOT, main() starts on the DFLL in open loop (48MHz within a few %) while the crystal
+// starts up, then the DFLL locks to it in the background and USB attaches.
+// Otherwise the clock is always locked before main().
+bool clockLocked( void );
+// callback runs from the SYSCTRL interrupt once the clock is locked, or immediately if it already is
+void onClockLocked( void (*callback)(void) );
 
 #ifdef __cplusplus
 }
@@ -22,6 +22,7 @@
 #include <stdio.h>
 
 #include "usb.h"
+#include "generic.h"
 
 /**
  * Temporary measure to remove variant.h
@@ -38,9 +39,33 @@
  */
 uint32_t SystemCoreClock=1000000ul ;
 
+// written by SystemInit before RAM is initialised
+NOINIT boot_times_t bootTimes;
+NOINIT static uint32_t _bootSwitchCount;  // SysTick count when the core switched to 48MHz
+static uint32_t _bootBaseMicros = 0;  // us from reset when SysTick was restarted for the ms tick
+
+#if defined(FAST_BOOT) && !defined(CRYSTALLESS)
+#ifdef TICKLESS_IDLE
+#error "FAST_BOOT can't be used with TICKLESS_IDLE, the RTC needs the 32kHz crystal running from reset"
+#endif
+// main() starts on the open loop DFLL and the crystal is brought up by SYSCTRL_Handler
+#define BOOT_DEFERRED_LOCK
+static volatile bool _clockLocked = false;
+static void (*_clockLockedCallback)(void) = NULL;
+#endif
+
+// SysTick free-runs from Reset_Handler, first at the 1MHz reset clock then at 48MHz
+// until SystemStart sets up the ms tick
+static inline uint32_t bootMicros( void )
+{
+  return _bootBaseMicros + micros();
+}
+
 
 /**
  * \brief SystemInit() configures the needed clocks and according Flash Read Wait States.
+ * It runs first thing in Reset_Handler so the rest of startup runs at 48MHz,
+ * .data and .bss aren't initialised yet so it must only use registers and .noinit variables.
  * At reset:
  * - OSC8M clock source is enabled with a divider by 8 (1MHz).
  * - Generic Clock Generator 0 (GCLKMAIN) is using OSC8M as source.
@@ -59,6 +84,7 @@ uint32_t SystemCoreClock=1000000ul ;
 #define GENERIC_CLOCK_GENERATOR_OSC32K    (1u)
 #define GENERIC_CLOCK_GENERATOR_OSCULP32K (2u) /* Initialized at reset for WDT */
 #define GENERIC_CLOCK_GENERATOR_OSC8M     (3u)
+#define GENERIC_CLOCK_GENERATOR_USB       (4u) /* DFLL48M, so USB keeps 48MHz whatever the core clock */
 // Constants for Clock multiplexers
 #define GENERIC_CLOCK_MULTIPLEXER_DFLL48M (0u)
 
@@ -86,6 +112,16 @@ void SystemInit( void )
 
   while ( (SYSCTRL->PCLKSR.reg & SYSCTRL_PCLKSR_OSC32KRDY) == 0 ); // Wait for oscillator stabilization
 
+#elif defined(BOOT_DEFERRED_LOCK)
+
+  /* ----------------------------------------------------------------------------------------------
+   * 1) Start XOSC32K clock (External on-board 32.768Hz oscillator)
+   * SYSCTRL_Handler does steps 2) and 3) and closes the DFLL loop once it is stable
+   */
+  SYSCTRL->XOSC32K.reg = SYSCTRL_XOSC32K_STARTUP( 0x6u ) | /* cf table 15.10 of product datasheet in chapter 15.8.6 */
+                         SYSCTRL_XOSC32K_XTALEN | SYSCTRL_XOSC32K_EN32K ;
+  SYSCTRL->XOSC32K.bit.ENABLE = 1 ; /* separate call, as described in chapter 15.6.3 */
+
 #else // has crystal
 
   /* ----------------------------------------------------------------------------------------------
@@ -113,6 +149,7 @@ void SystemInit( void )
     /* Wait for reset to complete */
   }
 
+#ifndef BOOT_DEFERRED_LOCK
   /* ----------------------------------------------------------------------------------------------
    * 2) Put XOSC32K as source of Generic Clock Generator 1
    */
@@ -150,6 +187,8 @@ void SystemInit( void )
     /* Wait for synchronization */
   }
 
+#endif
+
   /* ----------------------------------------------------------------------------------------------
    * 4) Enable DFLL48M clock
    */
@@ -173,7 +212,7 @@ void SystemInit( void )
     /* Wait for synchronization */
   }
 
-#if defined(CRYSTALLESS)
+#if defined(CRYSTALLESS) || defined(BOOT_DEFERRED_LOCK)
 
   #define NVM_SW_CALIB_DFLL48M_COARSE_VAL 58
 
@@ -201,6 +240,10 @@ void SystemInit( void )
     /* Wait for synchronization */
   }
 
+#if defined(BOOT_DEFERRED_LOCK)
+  /* Open loop from the factory calibration, within a few % of 48MHz until SYSCTRL_Handler closes the loop */
+  SYSCTRL->DFLLCTRL.reg = SYSCTRL_DFLLCTRL_ENABLE ;
+#else
   SYSCTRL->DFLLCTRL.reg =  SYSCTRL_DFLLCTRL_MODE |
                            SYSCTRL_DFLLCTRL_CCDIS |
                            SYSCTRL_DFLLCTRL_USBCRM | /* USB correction */
@@ -213,6 +256,7 @@ void SystemInit( void )
 
   /* Enable the DFLL */
   SYSCTRL->DFLLCTRL.reg |= SYSCTRL_DFLLCTRL_ENABLE ;
+#endif
 
 #else   // has crystal
 
@@ -245,6 +289,12 @@ void SystemInit( void )
   /* ----------------------------------------------------------------------------------------------
    * 5) Switch Generic Clock Generator 0 to DFLL48M. CPU will run at 48MHz.
    */
+  bootTimes.clock_us = SysTick_LOAD_RELOAD_Msk - SysTick->VAL ; /* 1MHz SysTick counts */
+#ifdef BOOT_DEFERRED_LOCK
+  bootTimes.lock_us = 0 ;
+#else
+  bootTimes.lock_us = bootTimes.clock_us ;
+#endif
   GCLK->GENDIV.reg = GCLK_GENDIV_ID( GENERIC_CLOCK_GENERATOR_MAIN ) ; // Generic Clock Generator 0
 
   while ( GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY )
@@ -263,6 +313,7 @@ void SystemInit( void )
   {
     /* Wait for synchronization */
   }
+  _bootSwitchCount = SysTick->VAL ;
 
   /* ----------------------------------------------------------------------------------------------
    * 6) Modify PRESCaler value of OSC8M to have 8MHz
@@ -295,8 +346,6 @@ void SystemInit( void )
   PM->APBBSEL.reg = PM_APBBSEL_APBBDIV_DIV1_Val ;
   PM->APBCSEL.reg = PM_APBCSEL_APBCDIV_DIV1_Val ;
 
-  SystemCoreClock=VARIANT_MCK ;
-
   /* ----------------------------------------------------------------------------------------------
    * 8) Load ADC factory calibration values
    */
@@ -316,16 +365,32 @@ void SystemInit( void )
    * 9) Disable automatic NVM write operations
    */
   NVMCTRL->CTRLB.bit.MANW = 1;
+}
+
+/**
+ * \brief SystemStart() finishes the setup that needs RAM, after Reset_Handler has initialised it
+ * and before the static constructors run.
+ */
+void SystemStart( void )
+{
+  SystemCoreClock=VARIANT_MCK ;
+  /* SysTick counted the 48MHz clock since the switch */
+  _bootBaseMicros = bootTimes.clock_us + (_bootSwitchCount - SysTick->VAL) / (VARIANT_MCK / 1000000) ;
 
   /*
    * 10) Set Systick to 1ms interval, common to all Cortex-M variants
    */
+#ifdef TICKLESS_IDLE
+  initTicks();  /* RTC from the 32kHz Generic Clock Generator 1 replaces Systick */
+#else
   if ( SysTick_Config( SystemCoreClock / 1000 ) )
   {
     // Capture error
     while ( 1 ) ;
   }
   NVIC_SetPriority (SysTick_IRQn,  (1 << __NVIC_PRIO_BITS) - 2);  /* set Priority for Systick Interrupt (2nd lowest) */
+#endif
+  NVIC_SetPriority (PendSV_IRQn,  (1 << __NVIC_PRIO_BITS) - 1);  /* deferred work runs below every other interrupt */
 
   /*
    * 11) Initialise USB serial port
@@ -335,6 +400,127 @@ void SystemInit( void )
   PORT->Group[0].PINCFG[PIN_PA24G_USB_DM].bit.PMUXEN = 1;
   PORT->Group[0].PINCFG[PIN_PA25G_USB_DP].bit.PMUXEN = 1;
   usb_init();
+
+  /* Generic Clock Generator 4 from DFLL48M for USB, so the core clock can be changed (see Clock.h) */
+  GCLK->GENDIV.reg = GCLK_GENDIV_ID( GENERIC_CLOCK_GENERATOR_USB ) ;
+  while ( GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY );
+  GCLK->GENCTRL.reg = GCLK_GENCTRL_ID( GENERIC_CLOCK_GENERATOR_USB ) |
+                      GCLK_GENCTRL_SRC_DFLL48M |
+                      GCLK_GENCTRL_IDC |
+                      GCLK_GENCTRL_GENEN ;
+  while ( GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY );
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID( USB_GCLK_ID ) |
+                      GCLK_CLKCTRL_GEN_GCLK4 |
+                      GCLK_CLKCTRL_CLKEN ;
+  while ( GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY );
+#ifndef BOOT_DEFERRED_LOCK
   usb_attach();
 #endif
+#endif
+
+#ifdef BOOT_DEFERRED_LOCK
+  /*
+   * 12) Finish the clock setup in SYSCTRL_Handler once XOSC32K is stable
+   */
+  SYSCTRL->INTFLAG.reg = SYSCTRL_INTFLAG_XOSC32KRDY | SYSCTRL_INTFLAG_DFLLLCKF ;
+  SYSCTRL->INTENSET.reg = SYSCTRL_INTENSET_XOSC32KRDY ;
+  NVIC_EnableIRQ( SYSCTRL_IRQn ) ;
+#endif
+}
+
+#ifdef BOOT_DEFERRED_LOCK
+
+void SYSCTRL_Handler( void )
+{
+  if ( SYSCTRL->INTFLAG.reg & SYSCTRL_INTFLAG_XOSC32KRDY )
+  {
+    SYSCTRL->INTENCLR.reg = SYSCTRL_INTENCLR_XOSC32KRDY ;
+    SYSCTRL->INTFLAG.reg = SYSCTRL_INTFLAG_XOSC32KRDY ;
+
+    /* 2) Put XOSC32K as source of Generic Clock Generator 1 */
+    GCLK->GENDIV.reg = GCLK_GENDIV_ID( GENERIC_CLOCK_GENERATOR_XOSC32K ) ;
+    while ( GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY );
+    GCLK->GENCTRL.reg = GCLK_GENCTRL_ID( GENERIC_CLOCK_GENERATOR_XOSC32K ) |
+                        GCLK_GENCTRL_SRC_XOSC32K |
+                        GCLK_GENCTRL_GENEN ;
+    while ( GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY );
+
+    /* 3) Put Generic Clock Generator 1 as source for Generic Clock Multiplexer 0 (DFLL48M reference) */
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID( GENERIC_CLOCK_MULTIPLEXER_DFLL48M ) |
+                        GCLK_CLKCTRL_GEN_GCLK1 |
+                        GCLK_CLKCTRL_CLKEN ;
+    while ( GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY );
+
+    /* Close the loop, tracking starts from the open loop value so the core clock only drifts slightly.
+     * No WAITLOCK as that would stop the core clock until the DFLL locks */
+    SYSCTRL->DFLLMUL.reg = SYSCTRL_DFLLMUL_CSTEP( 31 ) |
+                           SYSCTRL_DFLLMUL_FSTEP( 511 ) |
+                           SYSCTRL_DFLLMUL_MUL( (VARIANT_MCK + VARIANT_MAINOSC/2) / VARIANT_MAINOSC ) ;
+    while ( (SYSCTRL->PCLKSR.reg & SYSCTRL_PCLKSR_DFLLRDY) == 0 );
+    SYSCTRL->DFLLCTRL.reg = SYSCTRL_DFLLCTRL_ENABLE | SYSCTRL_DFLLCTRL_MODE | SYSCTRL_DFLLCTRL_QLDIS ;
+    while ( (SYSCTRL->PCLKSR.reg & SYSCTRL_PCLKSR_DFLLRDY) == 0 );
+
+    SYSCTRL->INTENSET.reg = SYSCTRL_INTENSET_DFLLLCKF ;
+  }
+
+  if ( SYSCTRL->INTFLAG.reg & SYSCTRL_INTFLAG_DFLLLCKF )
+  {
+    SYSCTRL->INTENCLR.reg = SYSCTRL_INTENCLR_DFLLLCKF ;
+    SYSCTRL->INTFLAG.reg = SYSCTRL_INTFLAG_DFLLLCKF ;
+
+    bootTimes.lock_us = bootMicros() ;
+    _clockLocked = true ;
+#ifdef USBCON
+    /* USB needs the locked clock */
+    usb_attach();
+#endif
+    if ( _clockLockedCallback )
+    {
+      _clockLockedCallback();
+    }
+  }
+}
+
+bool clockLocked( void )
+{
+  return _clockLocked ;
+}
+
+void onClockLocked( void (*callback)(void) )
+{
+  // may be called with interrupts already disabled, leave them as they were
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  _clockLockedCallback = callback ;
+  bool locked = _clockLocked ;
+  if ( !primask )
+  {
+    __enable_irq();
+  }
+  if ( locked && callback )
+  {
+    callback();
+  }
+}
+
+#else
+
+bool clockLocked( void )
+{
+  return true ;
+}
+
+void onClockLocked( void (*callback)(void) )
+{
+  if ( callback )
+  {
+    callback();
+  }
+}
+
+#endif
+
+void bootReachedMain( void )
+{
+  bootTimes.main_us = bootMicros() ;
 }
@@ -0,0 +1,63 @@
+#include "generic.h"
+#include "IO.h"
+#include "USBserial.h"
+#include "Async.h"
+
+// Blinks PA17 and echoes lines from the serial port as two independent tasks,
+// the core sleeps whenever both are waiting.
+
+class BlinkTask : public AsyncTask {
+    uint8_t run() {
+        ASYNC_BEGIN();
+        while (true) {
+            PORT->Group[PORTA].OUTTGL.reg = PORT_PA17;
+            ASYNC_SLEEP(500);
+        }
+        ASYNC_END();
+    }
+};
+
+class EchoTask : public AsyncTask {
+    char line[64];
+    uint8_t length;
+
+    uint8_t run() {
+        ASYNC_BEGIN();
+        ASYNC_AWAIT(usbserial.isOpen());
+        while (true) {
+            length = 0;
+            // collect a line, giving up on a partial line after a second of silence
+            while (length < sizeof(line)) {
+                ASYNC_AWAIT_TIMEOUT(usbserial.available(), 1000);
+                if (timedOut()) {
+                    break;
+                }
+                line[length] = usbserial.read_char();
+                if (line[length++] == '\n') {
+                    break;
+                }
+            }
+            if (length) {
+                usbserial.write(line, length);
+            }
+        }
+        ASYNC_END();
+    }
+};
+
+BlinkTask blink;
+EchoTask echo;
+
+int main( void ) {
+    // System is initialised in the Reset_Handler in cortex_handler.c
+
+    // set PA17 to output
+    PORT->Group[PORTA].PINCFG[17].reg = 0;
+    PORT->Group[PORTA].DIRSET.reg = PORT_PA17;
+
+    blink.start();
+    echo.start();
+    async_run();
+
+    return 0;
+}
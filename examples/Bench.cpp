@@ -0,0 +1,377 @@
+#include "generic.h"
+#include "RingBuffer.h"
+#include "PacketRingBuffer.h"
+#include "Critical.h"
+#ifdef USB_SERIAL_PACKET_MODE
+#include "USBpackets.h"
+#else
+#include "USBserial.h"
+#endif
+#include "Deferred.h"
+#include "Timer.h"
+
+// Cycle counts of the core hot paths, built with `make bench`.
+// Results are written over semihosting as "name,cycles" lines so they can be compared between builds,
+// the program must be run under a debugger with semihosting enabled or the BKPT will fault.
+// make bench DEFINES=-DUSB_SERIAL_PACKET_MODE times USBpackets in place of the USBserial cases,
+// the packet_ results compare with usb_rx_completion_64 and tx_direct_read_64 of a default build.
+
+// times each operation this many times and reports the average
+#define BENCH_REPEAT 64
+
+// semihosting SYS_WRITE0, writes a null terminated string to the debugger console
+static void semihost_write(const char* str) {
+    register uint32_t op asm("r0") = 0x04;
+    register const char* arg asm("r1") = str;
+    __asm__ __volatile__ ("bkpt 0xab" : "+r"(op) : "r"(arg) : "memory");
+}
+
+static void report(const char* name, uint32_t cycles) {
+    char num[11];
+    uint8_t idx = sizeof(num) - 1;
+    num[idx] = '\0';
+    do {
+        num[--idx] = '0' + (cycles % 10);
+        cycles /= 10;
+    } while (cycles);
+
+    semihost_write(name);
+    semihost_write(",");
+    semihost_write(num + idx);
+    semihost_write("\n");
+}
+
+// SysTick counts down once per core clock and reloads every ms,
+// so it can be used as a cycle counter for anything shorter than 1ms
+static inline uint32_t cycles_between(uint32_t start, uint32_t end) {
+    return (start >= end) ? (start - end) : (start + SysTick->LOAD + 1 - end);
+}
+static inline uint32_t cycles_since(uint32_t start) {
+    return cycles_between(start, SysTick->VAL);
+}
+
+static uint32_t overhead = 0;
+
+// average cycles of op, setup is run before each timed call and isn't counted
+template <typename Setup, typename Op> uint32_t bench(Setup setup, Op op) {
+    uint32_t total = 0;
+    for (uint16_t i = 0; i < BENCH_REPEAT; i++) {
+        setup();
+        __disable_irq();
+        __asm__ __volatile__ ("" ::: "memory");
+        uint32_t start = SysTick->VAL;
+        op();
+        total += cycles_since(start);
+        __asm__ __volatile__ ("" ::: "memory");
+        __enable_irq();
+    }
+    total /= BENCH_REPEAT;
+    return (total > overhead) ? (total - overhead) : 0;
+}
+
+static void no_setup() {}
+
+__attribute__((__aligned__(4))) uint8_t data[64 + 4] = {0};
+__attribute__((__aligned__(4))) uint8_t out[64 + 4];
+
+RingBuffer<256> ring;
+// the same without masking interrupts, for a main loop and a single interrupt sharing it
+RingBuffer<256, BUFFER_LOCK_FREE> ring_lock_free;
+RingBuffer<256, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE> tx_ring;
+PacketRingBuffer<128, 64> rx_ring;
+// a power of two size masks its indices, the generic version compares and wraps them
+RingBuffer<128> ring_pow2;
+RingBuffer<127> ring_generic;
+
+// the same operations on either, names are prefixed ring_pow2_ or ring_generic_
+template <typename Ring> void bench_ring_size(Ring& ring, const char* char_name, const char* used_name, const char* bulk_name) {
+    static Ring* r;
+    r = &ring;
+    report(char_name, bench(no_setup, []() {
+        r->store('a');
+        r->read_char();
+    }));
+    report(used_name, bench(no_setup, []() {
+        r->usedSpace();
+        r->availableSpace();
+    }));
+    // 48 bytes don't divide either size so the copies move across the wrap
+    report(bulk_name, bench(no_setup, []() {
+        r->store((const char*)data, 48);
+        r->read(out, 48);
+    }));
+}
+
+#ifndef USB_SERIAL_PACKET_MODE
+// Sustained CDC throughput with the buffer sizes the bench was built with,
+// e.g. make bench DEFINES=-DUSB_SERIAL_TX_BUFFER_LENGTH=256 to compare sizes.
+// The host must read everything sent for the tx rate and send continuously for the rx rate.
+// The names end in the endpoint mode, so make bench and make bench DEFINES=-DUSB_SERIAL_DOUBLE_BUFFER
+// give cdc_tx_bytes_per_s_single_bank and cdc_tx_bytes_per_s_dual_bank for the dual-bank before and after.
+#define BENCH_THROUGHPUT_MS 1000
+#ifdef USB_SERIAL_DOUBLE_BUFFER
+#define CDC_BANKS "_dual_bank"
+#else
+#define CDC_BANKS "_single_bank"
+#endif
+static uint32_t cdc_throughput(bool transmit) {
+    uint32_t bytes = 0;
+    uint32_t start = millis();
+    while ((millis() - start) < BENCH_THROUGHPUT_MS) {
+        bytes += transmit ? usbserial.write((const char*)data, 64) : usbserial.read((char*)out, 64);
+    }
+    return bytes * 1000 / BENCH_THROUGHPUT_MS;
+}
+#endif
+
+// USB completion path, these run from RAM unless built with make bench RAMFUNC=0
+static uint8_t* rx_packet;
+#ifdef USB_SERIAL_PACKET_MODE
+static uint8_t* tx_packet;
+#endif
+static void no_work(void* arg) {(void)arg;}
+static deferred_work_t bench_work = DEFERRED_WORK_INIT(no_work, NULL);
+
+// TC3 isn't used by the core, it is pended in software to time how long an interrupt waits
+static volatile uint32_t irq_entry;
+extern "C" void TC3_Handler(void) {
+    irq_entry = SysTick->VAL;
+}
+
+struct NoSection {
+    NoSection() {}
+};
+struct UsbMaskSection : IrqMaskSection {
+    UsbMaskSection() : IrqMaskSection(IRQ_LINE(USB_IRQn)) {}
+};
+
+// average cycles from pending TC3 inside a section to its handler starting,
+// the section is held for a 64 byte copy as a short driver operation would be
+template <typename Section> uint32_t irq_latency() {
+    uint32_t total = 0;
+    for (uint16_t i = 0; i < BENCH_REPEAT; i++) {
+        uint32_t start;
+        {
+            Section section;
+            start = SysTick->VAL;
+            NVIC_SetPendingIRQ(TC3_IRQn);
+            ringbuffer_copy(out, data, 64);
+        }
+        // let the interrupt be taken before reading when it ran
+        __DSB();
+        __ISB();
+        total += cycles_between(start, irq_entry);
+    }
+    return total / BENCH_REPEAT;
+}
+
+int main( void ) {
+    // System is initialised in the Reset_Handler in cortex_handler.c
+
+    // time from reset, built with FAST_BOOT the clock locks after main() has started
+    while (!clockLocked());
+    report("boot_clock_us", bootTimes.clock_us);
+    report("boot_main_us", bootTimes.main_us);
+    report("boot_lock_us", bootTimes.lock_us);
+
+    // cost of the timing itself
+    overhead = bench(no_setup, []() {});
+    report("overhead", overhead);
+
+#ifndef USB_SERIAL_PACKET_MODE
+    // only while a host has the port open, it has a few seconds to open it
+    report("cdc_tx_buffer_length", USB_SERIAL_TX_BUFFER_LENGTH);
+    report("cdc_rx_buffer_length", USB_SERIAL_RX_BUFFER_LENGTH);
+    uint32_t wait = millis();
+    while (!usbserial.isOpen() && ((millis() - wait) < 5000));
+    if (usbserial.isOpen()) {
+        report("cdc_tx_bytes_per_s" CDC_BANKS, cdc_throughput(true));
+        report("cdc_rx_bytes_per_s" CDC_BANKS, cdc_throughput(false));
+    }
+#endif
+
+    report("ring_store_read_char", bench(no_setup, []() {
+        ring.store('a');
+        ring.read_char();
+    }));
+    report("ring_store_read_16", bench(no_setup, []() {
+        ring.store((const char*)data, 16);
+        ring.read(out, 16);
+    }));
+    report("ring_store_read_64", bench(no_setup, []() {
+        ring.store((const char*)data, 64);
+        ring.read(out, 64);
+    }));
+    report("ring_lock_free_store_read_char", bench(no_setup, []() {
+        ring_lock_free.store('a');
+        ring_lock_free.read_char();
+    }));
+    report("ring_lock_free_store_read_16", bench(no_setup, []() {
+        ring_lock_free.store((const char*)data, 16);
+        ring_lock_free.read(out, 16);
+    }));
+    report("ring_lock_free_store_read_64", bench(no_setup, []() {
+        ring_lock_free.store((const char*)data, 64);
+        ring_lock_free.read(out, 64);
+    }));
+
+    bench_ring_size(ring_pow2, "ring_pow2_store_read_char", "ring_pow2_used_available", "ring_pow2_store_read_48");
+    bench_ring_size(ring_generic, "ring_generic_store_read_char", "ring_generic_used_available", "ring_generic_store_read_48");
+
+    // the transmit side of the USBserial callback chain, one packet per transfer
+    report("tx_direct_read_64", bench([]() {
+        tx_ring.store((const char*)data, 64);
+    }, []() {
+        RingBuffer<256, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE>::len_t len;
+        tx_ring.prepareDirectRead(&len, 64);
+        tx_ring.completeDirectRead(len);
+    }));
+    // a partial packet on an unaligned index takes the bounce buffer
+    report("tx_direct_read_unaligned_5", bench([]() {
+        tx_ring.store((const char*)data, 5);
+    }, []() {
+        RingBuffer<256, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE>::len_t len;
+        tx_ring.prepareDirectRead(&len, 64);
+        tx_ring.completeDirectRead(len);
+    }));
+
+    // the receive side, one packet slot per transfer
+    report("rx_direct_write_64", bench([]() {
+        rx_ring.clear();
+    }, []() {
+        PacketRingBuffer<128, 64>::len_t len;
+        rx_ring.prepareDirectWrite(&len);
+        rx_ring.completeDirectWrite(64);
+    }));
+    report("rx_read_64", bench([]() {
+        PacketRingBuffer<128, 64>::len_t len;
+        rx_ring.clear();
+        rx_ring.prepareDirectWrite(&len);
+        rx_ring.completeDirectWrite(64);
+    }, []() {
+        rx_ring.read(out, 64);
+    }));
+
+    // 64 byte copies for every source and destination alignment, against newlib's memcpy.
+    // Names are ringbuffer_copy_64_s<source offset>_d<destination offset> and memcpy_64_s<n>_d<n>
+    char copy_name[] = "ringbuffer_copy_64_s0_d0";
+    char memcpy_name[] = "memcpy_64_s0_d0";
+    for (uint8_t src_offset = 0; src_offset < 4; src_offset++) {
+        for (uint8_t dst_offset = 0; dst_offset < 4; dst_offset++) {
+            static uint8_t* src;
+            static uint8_t* dst;
+            src = data + src_offset;
+            dst = out + dst_offset;
+            copy_name[sizeof(copy_name) - 5] = '0' + src_offset;
+            copy_name[sizeof(copy_name) - 2] = '0' + dst_offset;
+            memcpy_name[sizeof(memcpy_name) - 5] = '0' + src_offset;
+            memcpy_name[sizeof(memcpy_name) - 2] = '0' + dst_offset;
+            report(copy_name, bench(no_setup, []() {
+                ringbuffer_copy(dst, src, 64);
+            }));
+            report(memcpy_name, bench(no_setup, []() {
+                memcpy(dst, src, 64);
+            }));
+        }
+    }
+
+#ifdef USB_SERIAL_PACKET_MODE
+    // The same for USBpackets, a received packet queued and another buffer taken from the pool.
+    // Taking the packet back each time keeps the receive limit clear, the transfer stays marked as running
+    // so releasing doesn't start a real one.
+    uint8_t rx_len;
+    rx_packet = usbpackets._receive_data_cb(NULL, 0, &rx_len);
+    report("packet_rx_completion_64", bench([]() {
+        uint8_t len;
+        usbpackets.release(usbpackets.receive(&len));
+    }, []() {
+        uint8_t len;
+        rx_packet = usbpackets._receive_data_cb(rx_packet, 64, &len);
+    }));
+    // the main loop taking a received packet and giving it back, the receive side of PacketEcho
+    report("packet_receive_release_64", bench([]() {
+        uint8_t len;
+        rx_packet = usbpackets._receive_data_cb(rx_packet, 64, &len);
+    }, []() {
+        uint8_t len;
+        usbpackets.release(usbpackets.receive(&len));
+    }));
+    report("packet_allocate_release", bench(no_setup, []() {
+        usbpackets.release(usbpackets.allocate());
+    }));
+
+    // The transmit side with the callback detached, so nothing reaches the endpoint.
+    // The first packet is started by hand and one is kept in flight, each submit then completes the oldest.
+    uint8_t tx_len;
+    usbserial_set_tx_callback(NULL);
+    usbpackets.submit(usbpackets.allocate(), 64);
+    usbpackets._send_data_cb(0, &tx_len);
+    report("packet_tx_submit_completion_64", bench([]() {
+        tx_packet = usbpackets.allocate();
+    }, []() {
+        uint8_t len;
+        usbpackets.submit(tx_packet, 64);
+        usbpackets._send_data_cb(64, &len);
+    }));
+    report("packet_tx_completion_64", bench([]() {
+        usbpackets.submit(usbpackets.allocate(), 64);
+    }, []() {
+        uint8_t len;
+        usbpackets._send_data_cb(64, &len);
+    }));
+    // send the last packets and give the endpoint back
+    while (usbpackets._send_data_cb(64, &tx_len));
+    usbserial_set_tx_callback(usbpackets_send_data_cb);
+#else
+    // a received packet handed to USBserial as the completion work does, without the endpoint registers.
+    // Reading the packet back each time keeps a slot free, the transfer stays marked as running
+    // so reading doesn't start a real one.
+    uint8_t rx_len;
+    rx_packet = usbserial._receive_data_cb(NULL, 0, &rx_len);
+    report("usb_rx_completion_64", bench([]() {
+        usbserial.read((char*)out, 64);
+    }, []() {
+        uint8_t len;
+        rx_packet = usbserial._receive_data_cb(rx_packet, 64, &len);
+    }));
+#endif
+    // posting and running an empty work item, the PendSV it pends runs with nothing left to do
+    report("deferred_post_run", bench(no_setup, []() {
+        deferred_post(&bench_work);
+        deferred_run();
+    }));
+    // no timers are armed, the cost of every tick while idle
+    report("timer_tick", bench(no_setup, []() {
+        timer_tick();
+    }));
+
+    report("millis", bench(no_setup, []() {
+        millis();
+    }));
+
+    // tickless, the RTC only times delays to ~30us so there's nothing to compare
+#ifndef TICKLESS_IDLE
+    // delay needs the SysTick interrupt so is timed using the ms count as well
+    uint32_t ms = millis();
+    uint32_t start = SysTick->VAL;
+    delay(1);
+    uint32_t end = SysTick->VAL;
+    ms = millis() - ms;
+    report("delay_1ms", ms * (SysTick->LOAD + 1) + start - end);
+#endif
+
+    // interrupt latency with every interrupt masked and with only the USB line masked,
+    // TC3 is unrelated so shouldn't be held up by the selective sections
+    NVIC_SetPriority(TC3_IRQn, 0);
+    NVIC_EnableIRQ(TC3_IRQn);
+    report("irq_latency_none", irq_latency<NoSection>());
+    report("irq_latency_critical_section", irq_latency<CriticalSection>());
+    report("irq_latency_usb_mask_section", irq_latency<UsbMaskSection>());
+    report("irq_latency_deferred_section", irq_latency<DeferredSection>());
+    NVIC_DisableIRQ(TC3_IRQn);
+
+    semihost_write("done\n");
+    while (1);
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include "generic.h"
+#include "USBpackets.h"
+
+// Echoes every received packet back to the host without copying it.
+// Add -DUSB_SERIAL_PACKET_MODE to CFLAGS_EXTRA to build this.
+
+int main( void ) {
+    // System is initialised in the Reset_Handler in cortex_handler.c
+
+    // wait for port to be opened
+    while (!usbpackets.isOpen());
+
+    uint8_t length;
+    uint8_t* packet;
+
+    while (1) {
+        // the received buffer is sent straight back and returns to the pool once sent
+        packet = usbpackets.receive(&length);
+        if (packet) {
+            usbpackets.submit(packet, length);
+        }
+    }
+
+    return 0;
+}
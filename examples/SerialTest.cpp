@@ -38,9 +38,9 @@ int main( void ) {
     char tmp_buffer[64];
 
     while (1) {
-        // receive string and return it
-        length = usbserial.read(tmp_buffer, 64);
-        usbserial.write(tmp_buffer, length);
+        // receive a line and return it, sleeping while waiting for data or buffer space
+        length = usbserial.read_until(tmp_buffer, 64, '\n');
+        usbserial.write_all(tmp_buffer, length);
     }
 
     return 0;
@@ -0,0 +1,189 @@
+// Host timings of the ring buffers over buffer sizes, transfer sizes and alignment modes, run with make bench.
+// Each case prints its ns per operation and bytes per second as bench,... CSV lines, see check.h.
+// They compare the code paths and buffer configurations with each other, the locked modes include masking
+// interrupts on the simulated core. The cycles on the SAMD21 come from examples/Bench.cpp.
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include "RingBuffer.h"
+#include "PacketRingBuffer.h"
+#include "check.h"
+
+// keep each case running for about this long
+#define BENCH_NS 10000000ULL
+
+static uint8_t source[2048];
+static uint8_t sink[2048];
+
+// time op over enough repeats to run for BENCH_NS and report it as moving bytes per op
+template <class op_t> static void bench(const char* name, uint32_t bytes, op_t op) {
+  typedef std::chrono::steady_clock clock_t;
+  uint64_t repeats = 0;
+  uint64_t batch = 64;
+  clock_t::time_point start = clock_t::now();
+  uint64_t elapsed = 0;
+  while (elapsed < BENCH_NS) {
+    for (uint64_t i = 0; i < batch; i++) {
+      op();
+    }
+    repeats += batch;
+    batch *= 2;
+    elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_t::now() - start).count();
+  }
+  double ns = (double)elapsed / repeats;
+  char result[96];
+  snprintf(result, sizeof(result), "%s_ns", name);
+  bench_result(result, ns, "ns/op");
+  if (bytes) {
+    snprintf(result, sizeof(result), "%s_bytes_per_s", name);
+    bench_result(result, bytes * 1e9 / ns, "bytes/s");
+  }
+}
+
+static const char* modeName(uint8_t flags) {
+  switch (flags) {
+  case 0:
+    return "locked";
+  case BUFFER_LOCK_FREE:
+    return "lockfree";
+  case BUFFER_USB_RX_ALIGN:
+    return "rxalign";
+  case BUFFER_USB_RX_ALIGN | BUFFER_LOCK_FREE:
+    return "rxalign_lockfree";
+  case BUFFER_USB_TX_ALIGN:
+    return "txalign";
+  case BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE:
+    return "txalign_lockfree";
+  default:
+    return "other";
+  }
+}
+
+// the main loop storing and reading len bytes at a time, the indices move round the whole buffer
+template <uint16_t N, uint8_t flags> static void benchStoreRead(uint16_t len) {
+  static RingBuffer<N, flags> buffer;
+  typedef typename RingBuffer<N, flags>::len_t len_t;
+  char name[64];
+  snprintf(name, sizeof(name), "store_read_N%u_len%u_%s", N, len, modeName(flags));
+  bench(name, len, [len]() {
+    buffer.store((const char*)source, (len_t)len);
+    buffer.read(sink, (len_t)len);
+  });
+}
+
+// the transmit path, the main loop stores len bytes and the USB interrupt sends them in 64 byte packets
+template <uint16_t N, uint8_t flags> static void benchSend(uint16_t len) {
+  static RingBuffer<N, flags> buffer;
+  typedef typename RingBuffer<N, flags>::len_t len_t;
+  char name[64];
+  snprintf(name, sizeof(name), "store_send_N%u_len%u_%s", N, len, modeName(flags));
+  bench(name, len, [len]() {
+    buffer.store((const char*)source, (len_t)len);
+    len_t sent;
+    do {
+      buffer.prepareDirectRead(&sent, 64);
+      buffer.completeDirectRead(sent);
+    } while (sent);
+  });
+}
+
+// the receive path, the USB interrupt receives a len byte packet and the main loop reads it
+template <uint16_t N, uint8_t flags> static void benchReceive(uint16_t len) {
+  static RingBuffer<N, flags> buffer;
+  typedef typename RingBuffer<N, flags>::len_t len_t;
+  char name[64];
+  snprintf(name, sizeof(name), "receive_read_N%u_len%u_%s", N, len, modeName(flags));
+  bench(name, len, [len]() {
+    // an unaligned head with BUFFER_USB_RX_ALIGN only takes a few bytes at a time
+    for (uint16_t received = 0; received < len;) {
+      len_t space;
+      uint8_t* data = buffer.prepareDirectWrite(&space);
+      space = min(space, (len_t)(len - received));
+      memcpy(data, source + received, space);
+      buffer.completeDirectWrite(space);
+      received += space;
+    }
+    buffer.read(sink, (len_t)len);
+  });
+}
+
+// packets of len bytes through the receive buffer USBserial uses with USB_SERIAL_DOUBLE_BUFFER
+template <uint16_t N, uint8_t P> static void benchPackets(uint16_t len) {
+  static PacketRingBuffer<N, P> buffer;
+  typedef typename PacketRingBuffer<N, P>::len_t len_t;
+  char name[64];
+  snprintf(name, sizeof(name), "packet_receive_read_N%u_P%u_len%u", N, P, len);
+  bench(name, len, [len]() {
+    len_t space;
+    uint8_t* data = buffer.prepareDirectWrite(&space);
+    memcpy(data, source, len);
+    buffer.completeDirectWrite(len);
+    buffer.read(sink, (len_t)len);
+  });
+}
+
+template <uint16_t N, uint8_t flags> static void benchSizes() {
+  static const uint16_t lengths[] = {1, 4, 16, 48, 64, 200};
+  for (uint8_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    if (lengths[i] >= N) {
+      break;
+    }
+    benchStoreRead<N, flags>(lengths[i]);
+    benchSend<N, flags>(lengths[i]);
+    benchReceive<N, flags>(lengths[i]);
+  }
+}
+
+template <uint16_t N> static void benchModes() {
+  benchSizes<N, 0>();
+  benchSizes<N, BUFFER_LOCK_FREE>();
+  benchSizes<N, BUFFER_USB_RX_ALIGN>();
+  benchSizes<N, BUFFER_USB_RX_ALIGN | BUFFER_LOCK_FREE>();
+  benchSizes<N, BUFFER_USB_TX_ALIGN>();
+  benchSizes<N, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE>();
+}
+
+// ringbuffer_copy for each alignment of source and destination
+static void benchCopy() {
+  static const uint16_t lengths[] = {4, 16, 64, 256, 1024};
+  for (uint8_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    for (uint8_t src = 0; src < 4; src++) {
+      for (uint8_t dst = 0; dst < 4; dst++) {
+        uint16_t len = lengths[i];
+        char name[64];
+        snprintf(name, sizeof(name), "copy_len%u_src%u_dst%u", len, src, dst);
+        bench(name, len, [=]() {
+          ringbuffer_copy(sink + dst, source + src, len);
+        });
+        snprintf(name, sizeof(name), "memcpy_len%u_src%u_dst%u", len, src, dst);
+        bench(name, len, [=]() {
+          memcpy(sink + dst, source + src, len);
+          __asm__ __volatile__ ("" : : : "memory");
+        });
+      }
+    }
+  }
+}
+
+int main() {
+  for (uint16_t i = 0; i < sizeof(source); i++) {
+    source[i] = (uint8_t)i;
+  }
+
+  benchModes<64>();
+  benchModes<128>();
+  benchModes<256>();
+  benchModes<300>();
+  benchModes<1024>();
+  // sizes that aren't a power of two or a multiple of 4 can't be used with the alignment modes
+  benchSizes<127, 0>();
+  benchSizes<127, BUFFER_LOCK_FREE>();
+
+  benchPackets<128, 64>(64);
+  benchPackets<128, 64>(16);
+  benchPackets<256, 64>(64);
+
+  benchCopy();
+  return 0;
+}
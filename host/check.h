@@ -0,0 +1,42 @@
+#pragma once
+
+// Checks and benchmark output for the host tests.
+// A failed check prints where it is and the test carries on, check_result() gives the exit code.
+// Benchmarks print one CSV line per result: bench,<variant>,<name>,<value>,<unit>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef HOST_VARIANT
+#define HOST_VARIANT "default"
+#endif
+
+static unsigned check_failures = 0;
+static unsigned check_count = 0;
+
+#define CHECK(cond) do { \
+    check_count++; \
+    if (!(cond)) { \
+      check_failures++; \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long long _a = (long long)(a); \
+    long long _b = (long long)(b); \
+    check_count++; \
+    if (_a != _b) { \
+      check_failures++; \
+      fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+    } \
+  } while (0)
+
+static inline void bench_result(const char* name, double value, const char* unit) {
+  printf("bench,%s,%s,%.6g,%s\n", HOST_VARIANT, name, value, unit);
+}
+
+static inline int check_result(const char* name) {
+  printf("%s [%s]: %u checks, %u failed\n", name, HOST_VARIANT, check_count, check_failures);
+  return check_failures ? 1 : 0;
+}
@@ -0,0 +1,315 @@
+#pragma once
+
+// Host stand-in for the CMSIS core and SAMD21 device headers, only what the core uses.
+// The registers are plain structs kept by sim.c. Each use of a peripheral macro (USB, RTC, SysTick,
+// SCB, NVIC) calls into the simulation first, so writes to the set/clear and write-1-to-clear registers
+// are applied and counters are brought up to the virtual time.
+// A register written twice through a saved pointer, with no use of the macro in between, only sees the
+// second write.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define F_CPU_SIM 48000000UL
+
+// ---------------------------------------------------------------------------------------------------------
+// Core
+
+#define __NVIC_PRIO_BITS 2
+
+typedef enum IRQn {
+  NonMaskableInt_IRQn = -14,
+  HardFault_IRQn      = -13,
+  SVCall_IRQn         = -5,
+  PendSV_IRQn         = -2,
+  SysTick_IRQn        = -1,
+  PM_IRQn             = 0,
+  SYSCTRL_IRQn        = 1,
+  WDT_IRQn            = 2,
+  RTC_IRQn            = 3,
+  EIC_IRQn            = 4,
+  NVMCTRL_IRQn        = 5,
+  DMAC_IRQn           = 6,
+  USB_IRQn            = 7,
+  PERIPH_COUNT_IRQn   = 28
+} IRQn_Type;
+
+extern uint32_t SystemCoreClock;
+
+// interrupt masking and sleep are run by the simulation
+extern volatile uint32_t sim_primask;
+void sim_enable_irq(void);
+void sim_wfi(void);
+void sim_system_reset(void);
+
+static inline uint32_t __get_PRIMASK(void) {return sim_primask;}
+static inline void __disable_irq(void) {sim_primask = 1; __atomic_signal_fence(__ATOMIC_SEQ_CST);}
+static inline void __enable_irq(void) {__atomic_signal_fence(__ATOMIC_SEQ_CST); sim_enable_irq();}
+// real fences so the lock-free code can be stressed from several host threads
+static inline void __DMB(void) {__atomic_thread_fence(__ATOMIC_SEQ_CST);}
+static inline void __DSB(void) {__atomic_thread_fence(__ATOMIC_SEQ_CST);}
+static inline void __ISB(void) {__atomic_thread_fence(__ATOMIC_SEQ_CST);}
+static inline void __WFI(void) {sim_wfi();}
+static inline void __NOP(void) {}
+static inline void NVIC_SystemReset(void) {sim_system_reset();}
+
+typedef struct {
+  volatile uint32_t CPUID;
+  volatile uint32_t ICSR;
+  volatile uint32_t VTOR;
+  volatile uint32_t AIRCR;
+  volatile uint32_t SCR;
+  volatile uint32_t CCR;
+} SCB_Type;
+
+#define SCB_ICSR_PENDSVSET_Msk (1UL << 28)
+#define SCB_ICSR_PENDSVCLR_Msk (1UL << 27)
+#define SCB_ICSR_PENDSTSET_Msk (1UL << 26)
+#define SCB_ICSR_PENDSTCLR_Msk (1UL << 25)
+
+typedef struct {
+  volatile uint32_t CTRL;
+  volatile uint32_t LOAD;
+  volatile uint32_t VAL;
+  volatile uint32_t CALIB;
+} SysTick_Type;
+
+#define SysTick_CTRL_COUNTFLAG_Msk (1UL << 16)
+#define SysTick_CTRL_CLKSOURCE_Msk (1UL << 2)
+#define SysTick_CTRL_TICKINT_Msk   (1UL << 1)
+#define SysTick_CTRL_ENABLE_Msk    (1UL << 0)
+#define SysTick_LOAD_RELOAD_Msk    0xFFFFFFUL
+
+typedef struct {
+  volatile uint32_t ISER[1];
+  uint32_t RESERVED0[31];
+  volatile uint32_t ICER[1];
+} NVIC_Type;
+
+SCB_Type* sim_scb(void);
+SysTick_Type* sim_systick(void);
+NVIC_Type* sim_nvic(void);
+#define SCB     (sim_scb())
+#define SysTick (sim_systick())
+#define NVIC    (sim_nvic())
+
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+void NVIC_SetPendingIRQ(IRQn_Type irq);
+void NVIC_ClearPendingIRQ(IRQn_Type irq);
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority);
+
+// ---------------------------------------------------------------------------------------------------------
+// RTC in 32-bit counter mode
+
+typedef union {
+  struct {
+    uint8_t CMP0:1;
+    uint8_t :5;
+    uint8_t SYNCRDY:1;
+    uint8_t OVF:1;
+  } bit;
+  uint8_t reg;
+} RTC_MODE0_INTFLAG_Type;
+
+typedef struct {
+  union {
+    struct {
+      uint16_t SWRST:1;
+      uint16_t ENABLE:1;
+      uint16_t MODE:2;
+      uint16_t :3;
+      uint16_t MATCHCLR:1;
+      uint16_t PRESCALER:4;
+      uint16_t :4;
+    } bit;
+    uint16_t reg;
+  } CTRL;
+  union {uint16_t reg;} READREQ;
+  union {uint16_t reg;} EVCTRL;
+  union {uint8_t reg;} INTENCLR;
+  union {uint8_t reg;} INTENSET;
+  RTC_MODE0_INTFLAG_Type INTFLAG;
+  uint8_t Reserved1;
+  union {
+    struct {
+      uint8_t :7;
+      uint8_t SYNCBUSY:1;
+    } bit;
+    uint8_t reg;
+  } STATUS;
+  union {uint8_t reg;} DBGCTRL;
+  union {uint8_t reg;} FREQCORR;
+  uint8_t Reserved2[3];
+  union {uint32_t reg;} COUNT;
+  uint8_t Reserved3[4];
+  union {uint32_t reg;} COMP[1];
+} RtcMode0;
+
+typedef union {
+  RtcMode0 MODE0;
+} Rtc;
+
+#define RTC_MODE0_CTRL_SWRST          (0x1u << 0)
+#define RTC_MODE0_CTRL_ENABLE         (0x1u << 1)
+#define RTC_MODE0_CTRL_MODE_COUNT32   (0x0u << 2)
+#define RTC_MODE0_CTRL_PRESCALER_DIV1 (0x0u << 8)
+#define RTC_READREQ_RCONT             (0x1u << 14)
+#define RTC_READREQ_RREQ              (0x1u << 15)
+#define RTC_MODE0_INTENSET_CMP0       (0x1u << 0)
+#define RTC_MODE0_INTENSET_OVF        (0x1u << 7)
+#define RTC_MODE0_INTFLAG_CMP0        (0x1u << 0)
+#define RTC_MODE0_INTFLAG_OVF         (0x1u << 7)
+
+Rtc* sim_rtc(void);
+#define RTC (sim_rtc())
+
+// ---------------------------------------------------------------------------------------------------------
+// Clocks, only written by initTicks
+
+typedef struct {
+  union {uint32_t reg;} APBAMASK;
+} Pm;
+#define PM_APBAMASK_RTC (0x1u << 5)
+
+typedef struct {
+  union {uint16_t reg;} CLKCTRL;
+  union {uint8_t reg;} STATUS;
+} Gclk;
+#define GCLK_CLKCTRL_ID(value)  ((value) & 0x3F)
+#define GCLK_CLKCTRL_GEN_GCLK1  (0x1u << 8)
+#define GCLK_CLKCTRL_CLKEN      (0x1u << 14)
+#define GCLK_STATUS_SYNCBUSY    (0x1u << 7)
+#define RTC_GCLK_ID 4
+
+extern Pm sim_pm;
+extern Gclk sim_gclk;
+#define PM   (&sim_pm)
+#define GCLK (&sim_gclk)
+
+// ---------------------------------------------------------------------------------------------------------
+// NVMCTRL, an erase is recorded for the reset that follows it
+
+typedef struct {
+  union {uint16_t reg;} CTRLA;
+  union {uint8_t reg;} INTFLAG;
+  union {uint16_t reg;} STATUS;
+  union {uint32_t reg;} ADDR;
+} Nvmctrl;
+#define NVMCTRL_CTRLA_CMD_ER     (0x02u << 0)
+#define NVMCTRL_CTRLA_CMDEX_KEY  (0xA5u << 8)
+#define NVMCTRL_INTFLAG_READY    (0x1u << 0)
+#define NVMCTRL_STATUS_MASK      0x011Fu
+
+extern Nvmctrl sim_nvmctrl;
+#define NVMCTRL (&sim_nvmctrl)
+
+// ---------------------------------------------------------------------------------------------------------
+// USB device endpoints
+
+typedef struct {
+  union {
+    struct {
+      uint8_t EPTYPE0:3;
+      uint8_t :1;
+      uint8_t EPTYPE1:3;
+      uint8_t NYETDIS:1;
+    } bit;
+    uint8_t reg;
+  } EPCFG;
+  uint8_t Reserved1[3];
+  union {uint8_t reg;} EPSTATUSCLR;
+  union {uint8_t reg;} EPSTATUSSET;
+  union {
+    struct {
+      uint8_t DTGLOUT:1;
+      uint8_t DTGLIN:1;
+      uint8_t CURBK:1;
+      uint8_t :1;
+      uint8_t STALLRQ0:1;
+      uint8_t STALLRQ1:1;
+      uint8_t BK0RDY:1;
+      uint8_t BK1RDY:1;
+    } bit;
+    uint8_t reg;
+  } EPSTATUS;
+  union {
+    struct {
+      uint8_t TRCPT0:1;
+      uint8_t TRCPT1:1;
+      uint8_t TRFAIL0:1;
+      uint8_t TRFAIL1:1;
+      uint8_t RXSTP:1;
+      uint8_t STALL0:1;
+      uint8_t STALL1:1;
+      uint8_t :1;
+    } bit;
+    uint8_t reg;
+  } EPINTFLAG;
+  union {uint8_t reg;} EPINTENCLR;
+  union {uint8_t reg;} EPINTENSET;
+  uint8_t Reserved2[22];
+} UsbDeviceEndpoint;
+
+typedef struct {
+  union {uint32_t reg;} ADDR;
+  union {
+    struct {
+      uint32_t BYTE_COUNT:14;
+      uint32_t MULTI_PACKET_SIZE:14;
+      uint32_t SIZE:3;
+      uint32_t AUTO_ZLP:1;
+    } bit;
+    uint32_t reg;
+  } PCKSIZE;
+  union {uint16_t reg;} EXTREG;
+  union {uint8_t reg;} STATUS_BK;
+  uint8_t Reserved1[5];
+} UsbDeviceDescBank;
+
+typedef struct {
+  UsbDeviceDescBank DeviceDescBank[2];
+} UsbDeviceDescriptor;
+
+typedef struct {
+  UsbDeviceEndpoint DeviceEndpoint[8];
+} UsbDevice;
+
+typedef union {
+  UsbDevice DEVICE;
+} Usb;
+
+#define USB_DEVICE_EPCFG_EPTYPE0(value) (((value) & 0x7u) << 0)
+#define USB_DEVICE_EPCFG_EPTYPE1(value) (((value) & 0x7u) << 4)
+
+#define USB_DEVICE_EPSTATUS_DTGLOUT  (0x1u << 0)
+#define USB_DEVICE_EPSTATUS_DTGLIN   (0x1u << 1)
+#define USB_DEVICE_EPSTATUS_CURBK    (0x1u << 2)
+#define USB_DEVICE_EPSTATUS_STALLRQ0 (0x1u << 4)
+#define USB_DEVICE_EPSTATUS_STALLRQ1 (0x1u << 5)
+#define USB_DEVICE_EPSTATUS_BK0RDY   (0x1u << 6)
+#define USB_DEVICE_EPSTATUS_BK1RDY   (0x1u << 7)
+#define USB_DEVICE_EPSTATUSCLR_DTGLOUT USB_DEVICE_EPSTATUS_DTGLOUT
+#define USB_DEVICE_EPSTATUSCLR_DTGLIN  USB_DEVICE_EPSTATUS_DTGLIN
+#define USB_DEVICE_EPSTATUSCLR_CURBK   USB_DEVICE_EPSTATUS_CURBK
+#define USB_DEVICE_EPSTATUSCLR_BK0RDY  USB_DEVICE_EPSTATUS_BK0RDY
+#define USB_DEVICE_EPSTATUSCLR_BK1RDY  USB_DEVICE_EPSTATUS_BK1RDY
+#define USB_DEVICE_EPSTATUSSET_BK0RDY  USB_DEVICE_EPSTATUS_BK0RDY
+#define USB_DEVICE_EPSTATUSSET_BK1RDY  USB_DEVICE_EPSTATUS_BK1RDY
+
+#define USB_DEVICE_EPINTFLAG_TRCPT0  (0x1u << 0)
+#define USB_DEVICE_EPINTFLAG_TRCPT1  (0x1u << 1)
+#define USB_DEVICE_EPINTENSET_TRCPT0 USB_DEVICE_EPINTFLAG_TRCPT0
+#define USB_DEVICE_EPINTENSET_TRCPT1 USB_DEVICE_EPINTFLAG_TRCPT1
+
+Usb* sim_usb(void);
+#define USB (sim_usb())
+
+#ifdef __cplusplus
+}
+#endif
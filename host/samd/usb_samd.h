@@ -0,0 +1,21 @@
+#pragma once
+
+// Host stand-in for the SAMD21 part of the USB stack, the endpoint descriptors
+// are read by the simulated device controller in sim.c
+
+#include <samd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_ENDPOINTS(NUM_EP) \
+  const uint8_t usb_num_endpoints = (NUM_EP); \
+  UsbDeviceDescriptor usb_endpoints[(NUM_EP) + 1] __attribute__((aligned(4)))
+
+extern const uint8_t usb_num_endpoints;
+extern UsbDeviceDescriptor usb_endpoints[];
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1031 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <samd.h>
+#include "sim.h"
+#include "usb.h"
+#include "samd/usb_samd.h"
+#include "USB-CDC.h"
+
+// the core's handlers, which of them exist depends on the build
+void SysTick_Handler(void) __attribute__((weak));
+void RTC_Handler(void) __attribute__((weak));
+void deferred_run(void);
+
+#define NEVER UINT64_MAX
+#define THREAD_PRIORITY 4  // below every exception
+
+#define RTC_HZ 32768
+
+// Full speed is 12Mbit/s, a transaction is its data plus ~13 bytes of token, handshake, CRC and gaps,
+// so up to 19 packets of 64 bytes fit in each 1ms frame
+#define BUS_CYCLES_PER_BYTE (F_CPU_SIM / (12000000 / 8))
+#define BUS_OVERHEAD_BYTES 13
+#define PACKET_SIZE 64
+
+#define EPTYPE_DUAL_BANK 5  // the bank of the other direction is a second bank
+
+// reserved bits of the write-1-to-clear flag registers, a write clears them
+#define RTC_INTFLAG_MARK 0x20
+#define USB_INTFLAG_MARK 0x80
+
+volatile uint32_t sim_primask = 0;
+uint32_t SystemCoreClock = F_CPU_SIM;
+Pm sim_pm;
+Gclk sim_gclk;
+Nvmctrl sim_nvmctrl = {.INTFLAG = {.reg = NVMCTRL_INTFLAG_READY}};
+// the start of the application, the reset into the bootloader erases the row after it
+const uint32_t __text_start__ = 0;
+
+jmp_buf* sim_reset_target = NULL;
+uint32_t sim_rtc_reset_count = 0;
+
+static uint64_t now = 0;
+static sim_reset_info_t resetInfo;
+
+static void fatal(const char* msg) {
+  fprintf(stderr, "sim: %s at %llu us\n", msg, (unsigned long long)sim_micros());
+  exit(2);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Exceptions
+
+enum {EXC_USB, EXC_RTC, EXC_SYSTICK, EXC_PENDSV, EXC_COUNT};
+
+static uint8_t excPriority[EXC_COUNT];
+static bool excPending[EXC_COUNT];
+static uint32_t nvicEnabled = 0;
+static uint8_t execPriority = THREAD_PRIORITY;
+static uint8_t handlerDepth = 0;
+
+static int excOfIrq(IRQn_Type irq) {
+  switch (irq) {
+    case USB_IRQn: return EXC_USB;
+    case RTC_IRQn: return EXC_RTC;
+    case SysTick_IRQn: return EXC_SYSTICK;
+    case PendSV_IRQn: return EXC_PENDSV;
+    default: return -1;
+  }
+}
+
+static void sync(void);
+static void service(void);
+static bool usbLevel(void);
+static bool rtcLevel(void);
+static void usbHandler(void);
+
+// ---------------------------------------------------------------------------------------------------------
+// SCB, only ICSR's pending bits
+
+static SCB_Type scbRegs;
+
+static void scbFold(void) {
+  uint32_t icsr = scbRegs.ICSR;
+  if (icsr & SCB_ICSR_PENDSVSET_Msk) {
+    excPending[EXC_PENDSV] = true;
+  }
+  if (icsr & SCB_ICSR_PENDSVCLR_Msk) {
+    excPending[EXC_PENDSV] = false;
+  }
+  if (icsr & SCB_ICSR_PENDSTSET_Msk) {
+    excPending[EXC_SYSTICK] = true;
+  }
+  if (icsr & SCB_ICSR_PENDSTCLR_Msk) {
+    excPending[EXC_SYSTICK] = false;
+  }
+}
+static void scbPresent(void) {
+  scbRegs.ICSR = excPending[EXC_SYSTICK] ? SCB_ICSR_PENDSTSET_Msk : 0;
+}
+static void setPending(int exc, bool pending) {
+  scbFold();
+  excPending[exc] = pending;
+  scbPresent();
+}
+
+SCB_Type* sim_scb(void) {
+  scbFold();
+  scbPresent();
+  return &scbRegs;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// NVIC
+
+static NVIC_Type nvicRegs;
+
+static void nvicFold(void) {
+  nvicEnabled |= nvicRegs.ISER[0];
+  nvicEnabled &= ~nvicRegs.ICER[0];
+}
+static void nvicPresent(void) {
+  nvicRegs.ISER[0] = nvicEnabled;
+  nvicRegs.ICER[0] = 0;
+}
+
+NVIC_Type* sim_nvic(void) {
+  nvicFold();
+  nvicPresent();
+  return &nvicRegs;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq) {
+  nvicFold();
+  nvicEnabled |= (1UL << irq);
+  nvicPresent();
+  if (!sim_primask) {
+    service();
+  }
+}
+void NVIC_DisableIRQ(IRQn_Type irq) {
+  nvicFold();
+  nvicEnabled &= ~(1UL << irq);
+  nvicPresent();
+}
+void NVIC_SetPendingIRQ(IRQn_Type irq) {
+  int exc = excOfIrq(irq);
+  if (exc >= 0) {
+    setPending(exc, true);
+  }
+  if (!sim_primask) {
+    service();
+  }
+}
+void NVIC_ClearPendingIRQ(IRQn_Type irq) {
+  int exc = excOfIrq(irq);
+  if (exc >= 0) {
+    setPending(exc, false);
+  }
+}
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority) {
+  int exc = excOfIrq(irq);
+  if (exc >= 0) {
+    excPriority[exc] = priority & ((1 << __NVIC_PRIO_BITS) - 1);
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// SysTick, counts down from LOAD to 0 and reloads, pending the interrupt as it reaches 0.
+// COUNTFLAG isn't kept.
+
+static SysTick_Type systickRegs;
+static bool stRunning = false;
+static uint64_t stZeroAt;  // when the count next reaches 0, while running
+static uint32_t stValue;   // count while stopped
+static uint32_t stLoad;
+static uint32_t stCtrl;
+static uint32_t stShown;   // VAL last presented, anything else was written
+
+static uint32_t systickValue(void) {
+  if (!stRunning) {
+    return stValue;
+  }
+  uint64_t left = stZeroAt - now;
+  return (left > stLoad) ? stLoad : (uint32_t)left;
+}
+
+static void systickFold(void) {
+  stLoad = systickRegs.LOAD & SysTick_LOAD_RELOAD_Msk;
+  if (systickRegs.VAL != stShown) {
+    // a write clears the count, it reloads on the next cycle
+    if (stRunning) {
+      stZeroAt = now + stLoad + 1;
+    } else {
+      stValue = 0;
+    }
+  }
+  uint32_t ctrl = systickRegs.CTRL & ~SysTick_CTRL_COUNTFLAG_Msk;
+  bool run = ctrl & SysTick_CTRL_ENABLE_Msk;
+  if (run && !stRunning) {
+    stZeroAt = now + (stValue ? stValue : stLoad + 1);
+  } else if (!run && stRunning) {
+    stValue = systickValue();
+  }
+  stRunning = run;
+  stCtrl = ctrl;
+}
+static void systickPresent(void) {
+  stShown = systickValue();
+  systickRegs.VAL = stShown;
+  systickRegs.CTRL = stCtrl;
+}
+static void systickProcess(void) {
+  while (stRunning && (stZeroAt <= now)) {
+    if (stCtrl & SysTick_CTRL_TICKINT_Msk) {
+      setPending(EXC_SYSTICK, true);
+    }
+    stZeroAt += stLoad + 1;
+  }
+}
+
+SysTick_Type* sim_systick(void) {
+  systickFold();
+  systickPresent();
+  return &systickRegs;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// RTC in 32-bit counter mode, from the 32.768kHz clock
+
+static Rtc rtcRegs;
+static bool rtcRunning = false;
+static uint64_t rtcBase;       // cycles when it last started
+static uint64_t rtcBaseCount;  // 64-bit count at rtcBase, or while stopped
+static uint64_t rtcLast;       // count the compare and overflow have been checked up to
+static uint8_t rtcFlags;
+static uint8_t rtcInten;
+static uint16_t rtcCtrl;
+
+static uint64_t rtcCountAt(uint64_t cycles) {
+  if (!rtcRunning) {
+    return rtcBaseCount;
+  }
+  return rtcBaseCount + ((cycles - rtcBase) * RTC_HZ) / F_CPU_SIM;
+}
+// the first cycle the count reaches count
+static uint64_t rtcCyclesFor(uint64_t count) {
+  return rtcBase + (((count - rtcBaseCount) * F_CPU_SIM) + RTC_HZ - 1) / RTC_HZ;
+}
+static uint64_t rtcNextMatch(void) {
+  uint64_t match = (rtcLast & ~0xFFFFFFFFULL) | rtcRegs.MODE0.COMP[0].reg;
+  if (match <= rtcLast) {
+    match += (1ULL << 32);
+  }
+  return match;
+}
+static uint64_t rtcNextOverflow(void) {
+  return (rtcLast | 0xFFFFFFFFULL) + 1;
+}
+
+static void rtcFold(void) {
+  RtcMode0* regs = &rtcRegs.MODE0;
+  if (regs->CTRL.reg & RTC_MODE0_CTRL_SWRST) {
+    rtcRunning = false;
+    rtcBaseCount = sim_rtc_reset_count;
+    rtcLast = rtcBaseCount;
+    rtcFlags = 0;
+    rtcInten = 0;
+    memset(regs, 0, sizeof(*regs));
+  } else {
+    bool enable = regs->CTRL.reg & RTC_MODE0_CTRL_ENABLE;
+    if (enable && !rtcRunning) {
+      rtcBase = now;
+      rtcRunning = true;
+    } else if (!enable && rtcRunning) {
+      rtcBaseCount = rtcCountAt(now);
+      rtcRunning = false;
+    }
+  }
+  rtcCtrl = regs->CTRL.reg;
+  if (!(regs->INTFLAG.reg & RTC_INTFLAG_MARK)) {
+    rtcFlags &= ~regs->INTFLAG.reg;
+  }
+  rtcInten |= regs->INTENSET.reg;
+  rtcInten &= ~regs->INTENCLR.reg;
+}
+static void rtcPresent(void) {
+  RtcMode0* regs = &rtcRegs.MODE0;
+  regs->CTRL.reg = rtcCtrl;
+  regs->INTFLAG.reg = rtcFlags | RTC_INTFLAG_MARK;
+  regs->INTENSET.reg = rtcInten;
+  regs->INTENCLR.reg = 0;
+  regs->STATUS.reg = 0;
+  regs->COUNT.reg = (uint32_t)rtcCountAt(now);
+}
+static void rtcProcess(void) {
+  if (!rtcRunning) {
+    return;
+  }
+  uint64_t count = rtcCountAt(now);
+  if (count > rtcLast) {
+    if (rtcNextMatch() <= count) {
+      rtcFlags |= RTC_MODE0_INTFLAG_CMP0;
+    }
+    if (rtcNextOverflow() <= count) {
+      rtcFlags |= RTC_MODE0_INTFLAG_OVF;
+    }
+    rtcLast = count;
+  }
+}
+static uint64_t rtcNextEvent(void) {
+  if (!rtcRunning) {
+    return NEVER;
+  }
+  uint64_t match = rtcNextMatch();
+  uint64_t overflow = rtcNextOverflow();
+  return rtcCyclesFor((match < overflow) ? match : overflow);
+}
+static bool rtcLevel(void) {
+  return rtcFlags & rtcInten & (RTC_MODE0_INTFLAG_CMP0 | RTC_MODE0_INTFLAG_OVF);
+}
+
+Rtc* sim_rtc(void) {
+  rtcFold();
+  rtcPresent();
+  return &rtcRegs;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// USB device controller
+
+#define EP_COUNT 8
+#define EP_IN  (USB_EP_CDC_IN & 0x3f)
+#define EP_OUT (USB_EP_CDC_OUT & 0x3f)
+
+static Usb usbRegs;
+static uint8_t epStatus[EP_COUNT];
+static uint8_t epFlags[EP_COUNT];
+static uint8_t epInten[EP_COUNT];
+
+USB_SetupPacket usb_setup;
+USB_ALIGN uint8_t ep0_buf_in[USB_EP0_SIZE];
+USB_ALIGN uint8_t ep0_buf_out[USB_EP0_SIZE];
+static usb_size ep0OutLength = 0;
+static bool controlStalled = false;
+
+static void usbFold(void) {
+  for (uint8_t n = 0; n < EP_COUNT; n++) {
+    UsbDeviceEndpoint* regs = &usbRegs.DEVICE.DeviceEndpoint[n];
+    epStatus[n] |= regs->EPSTATUSSET.reg;
+    epStatus[n] &= ~regs->EPSTATUSCLR.reg;
+    if (!(regs->EPINTFLAG.reg & USB_INTFLAG_MARK)) {
+      epFlags[n] &= ~regs->EPINTFLAG.reg;
+    }
+    epInten[n] |= regs->EPINTENSET.reg;
+    epInten[n] &= ~regs->EPINTENCLR.reg;
+  }
+}
+static void usbPresent(void) {
+  for (uint8_t n = 0; n < EP_COUNT; n++) {
+    UsbDeviceEndpoint* regs = &usbRegs.DEVICE.DeviceEndpoint[n];
+    regs->EPSTATUSSET.reg = 0;
+    regs->EPSTATUSCLR.reg = 0;
+    regs->EPSTATUS.reg = epStatus[n];
+    regs->EPINTFLAG.reg = epFlags[n] | USB_INTFLAG_MARK;
+    regs->EPINTENSET.reg = epInten[n];
+    regs->EPINTENCLR.reg = 0;
+  }
+}
+
+Usb* sim_usb(void) {
+  usbFold();
+  usbPresent();
+  return &usbRegs;
+}
+
+static UsbDeviceDescBank* epBank(uint8_t n, uint8_t bank) {
+  if (n > usb_num_endpoints) {
+    fatal("endpoint without a descriptor");
+  }
+  return &usb_endpoints[n].DeviceDescBank[bank];
+}
+static uint8_t epType(uint8_t n, uint8_t bank) {
+  uint8_t cfg = usbRegs.DEVICE.DeviceEndpoint[n].EPCFG.reg;
+  return bank ? ((cfg >> 4) & 0x7) : (cfg & 0x7);
+}
+static uint8_t bankReady(uint8_t bank) {
+  return bank ? USB_DEVICE_EPSTATUS_BK1RDY : USB_DEVICE_EPSTATUS_BK0RDY;
+}
+static uint8_t bankFlag(uint8_t bank) {
+  return bank ? USB_DEVICE_EPINTFLAG_TRCPT1 : USB_DEVICE_EPINTFLAG_TRCPT0;
+}
+// IN uses bank 1, or both alternately when bank 0 is configured as its second bank
+static bool inEnabled(uint8_t n) {
+  uint8_t type = epType(n, 1);
+  return type && (type != EPTYPE_DUAL_BANK);
+}
+static bool inDual(uint8_t n) {
+  return epType(n, 0) == EPTYPE_DUAL_BANK;
+}
+static uint8_t inBank(uint8_t n) {
+  return inDual(n) ? ((epStatus[n] & USB_DEVICE_EPSTATUS_CURBK) ? 1 : 0) : 1;
+}
+// OUT uses bank 0, or both alternately when bank 1 is configured as its second bank
+static bool outEnabled(uint8_t n) {
+  uint8_t type = epType(n, 0);
+  return type && (type != EPTYPE_DUAL_BANK);
+}
+static bool outDual(uint8_t n) {
+  return epType(n, 1) == EPTYPE_DUAL_BANK;
+}
+static uint8_t outBank(uint8_t n) {
+  return outDual(n) ? ((epStatus[n] & USB_DEVICE_EPSTATUS_CURBK) ? 1 : 0) : 0;
+}
+
+static uint8_t sizeCode(usb_size size) {
+  uint8_t code = 0;
+  while ((code < 7) && ((8U << code) < size)) {
+    code++;
+  }
+  return code;
+}
+
+// The stack's endpoint functions, as usb_samd.c
+void usb_enable_ep(uint8_t ep, uint8_t type, usb_size bufsize) {
+  uint8_t n = ep & 0x3f;
+  UsbDeviceEndpoint* regs = &usbRegs.DEVICE.DeviceEndpoint[n];
+  usbFold();
+  if (ep & 0x80) {
+    epBank(n, 1)->PCKSIZE.bit.SIZE = sizeCode(bufsize);
+    regs->EPCFG.bit.EPTYPE1 = type + 1;
+    epStatus[n] &= ~(USB_DEVICE_EPSTATUS_BK1RDY | USB_DEVICE_EPSTATUS_STALLRQ1 | USB_DEVICE_EPSTATUS_DTGLIN);
+  } else {
+    epBank(n, 0)->PCKSIZE.bit.SIZE = sizeCode(bufsize);
+    regs->EPCFG.bit.EPTYPE0 = type + 1;
+    // the bank holds nothing to receive into until a transfer is started
+    epStatus[n] |= USB_DEVICE_EPSTATUS_BK0RDY;
+    epStatus[n] &= ~(USB_DEVICE_EPSTATUS_STALLRQ0 | USB_DEVICE_EPSTATUS_DTGLOUT);
+  }
+  usbPresent();
+}
+
+void usb_disable_ep(uint8_t ep) {
+  uint8_t n = ep & 0x3f;
+  UsbDeviceEndpoint* regs = &usbRegs.DEVICE.DeviceEndpoint[n];
+  usbFold();
+  if (ep & 0x80) {
+    regs->EPCFG.bit.EPTYPE1 = 0;
+    epStatus[n] &= ~USB_DEVICE_EPSTATUS_BK1RDY;
+    epInten[n] &= ~USB_DEVICE_EPINTFLAG_TRCPT1;
+  } else {
+    regs->EPCFG.bit.EPTYPE0 = 0;
+    epStatus[n] &= ~USB_DEVICE_EPSTATUS_BK0RDY;
+    epInten[n] &= ~USB_DEVICE_EPINTFLAG_TRCPT0;
+  }
+  usbPresent();
+}
+
+void usb_ep_start_out(uint8_t ep, uint8_t* data, usb_size len) {
+  uint8_t n = ep & 0x3f;
+  UsbDeviceDescBank* bank = epBank(n, 0);
+  usbFold();
+  bank->PCKSIZE.bit.MULTI_PACKET_SIZE = len;
+  bank->PCKSIZE.bit.BYTE_COUNT = 0;
+  bank->ADDR.reg = (uintptr_t)data;
+  epFlags[n] &= ~USB_DEVICE_EPINTFLAG_TRCPT0;
+  epInten[n] |= USB_DEVICE_EPINTENSET_TRCPT0;
+  epStatus[n] &= ~USB_DEVICE_EPSTATUS_BK0RDY;
+  usbPresent();
+}
+
+void usb_ep_start_in(uint8_t ep, const uint8_t* data, usb_size size, bool zlp) {
+  uint8_t n = ep & 0x3f;
+  UsbDeviceDescBank* bank = epBank(n, 1);
+  usbFold();
+  bank->PCKSIZE.bit.AUTO_ZLP = zlp;
+  bank->PCKSIZE.bit.MULTI_PACKET_SIZE = 0;
+  bank->PCKSIZE.bit.BYTE_COUNT = size;
+  bank->ADDR.reg = (uintptr_t)data;
+  epFlags[n] &= ~USB_DEVICE_EPINTFLAG_TRCPT1;
+  epInten[n] |= USB_DEVICE_EPINTENSET_TRCPT1;
+  epStatus[n] |= USB_DEVICE_EPSTATUS_BK1RDY;
+  usbPresent();
+}
+
+bool usb_ep_pending(uint8_t ep) {
+  uint8_t n = ep & 0x3f;
+  usbFold();
+  usbPresent();
+  return epFlags[n] & ((ep & 0x80) ? USB_DEVICE_EPINTFLAG_TRCPT1 : USB_DEVICE_EPINTFLAG_TRCPT0);
+}
+bool usb_ep_empty(uint8_t ep) {
+  uint8_t n = ep & 0x3f;
+  uint8_t ready = (ep & 0x80) ? USB_DEVICE_EPSTATUS_BK1RDY : USB_DEVICE_EPSTATUS_BK0RDY;
+  return !((epStatus[n] & ready) || usb_ep_pending(ep));
+}
+bool usb_ep_ready(uint8_t ep) {
+  return usb_ep_empty(ep);
+}
+void usb_ep_handled(uint8_t ep) {
+  uint8_t n = ep & 0x3f;
+  usbFold();
+  epFlags[n] &= ~((ep & 0x80) ? USB_DEVICE_EPINTFLAG_TRCPT1 : USB_DEVICE_EPINTFLAG_TRCPT0);
+  usbPresent();
+}
+usb_size usb_ep_out_length(uint8_t ep) {
+  uint8_t n = ep & 0x3f;
+  if (n == 0) {
+    return ep0OutLength;
+  }
+  return epBank(n, 0)->PCKSIZE.bit.BYTE_COUNT;
+}
+
+void usb_ep0_out(void) {
+}
+void usb_ep0_in(uint8_t size) {
+  (void)size;
+}
+void usb_ep0_stall(void) {
+  controlStalled = true;
+}
+
+void* usb_string_to_descriptor(char* str) {
+  static USB_ALIGN uint8_t buffer[USB_STRING_LEN(63)];
+  USB_StringDescriptor* desc = (USB_StringDescriptor*)buffer;
+  size_t len = strlen(str);
+  if (len > 63) {
+    len = 63;
+  }
+  desc->bLength = USB_STRING_LEN(len);
+  desc->bDescriptorType = USB_DTYPE_String;
+  for (size_t i = 0; i < len; i++) {
+    desc->bString[i] = str[i];
+  }
+  return desc;
+}
+
+// The host's side of the bus
+
+typedef struct {
+  uint8_t len;
+  uint8_t data[PACKET_SIZE];
+} packet_t;
+
+#define OUT_QUEUE_PACKETS 4096
+#define IN_BUFFER_SIZE (1 << 20)
+
+static packet_t outQueue[OUT_QUEUE_PACKETS];
+static uint32_t outHead = 0;
+static uint32_t outTail = 0;
+static uint8_t inBuffer[IN_BUFFER_SIZE];
+static uint32_t inHead = 0;
+static uint32_t inTail = 0;
+static bool pollIn = true;
+static sim_usb_stats_t usbStats;
+
+typedef enum {TXN_NONE, TXN_IN, TXN_OUT} txn_t;
+static txn_t txn = TXN_NONE;
+static uint8_t txnBank;
+static uint64_t txnEnd;
+static bool preferOut = false;
+
+typedef enum {CONTROL_RESET, CONTROL_CONFIGURE, CONTROL_CLASS} control_type_t;
+typedef struct {
+  control_type_t type;
+  USB_SetupPacket setup;
+  uint8_t data[8];
+} control_t;
+
+#define CONTROL_QUEUE 8
+static control_t controlQueue[CONTROL_QUEUE];
+static uint8_t controlHead = 0;
+static uint8_t controlTail = 0;
+
+static bool inReady(void) {
+  return pollIn && inEnabled(EP_IN) && (epStatus[EP_IN] & bankReady(inBank(EP_IN)));
+}
+static bool outReady(void) {
+  return (outHead != outTail) && outEnabled(EP_OUT) && !(epStatus[EP_OUT] & bankReady(outBank(EP_OUT)));
+}
+
+static void startTransaction(void) {
+  bool in = inReady();
+  bool out = outReady();
+  if (in && out) {
+    // take turns while both have something to move
+    in = !preferOut;
+    out = preferOut;
+  }
+  if (in) {
+    txnBank = inBank(EP_IN);
+    uint32_t len = epBank(EP_IN, txnBank)->PCKSIZE.bit.BYTE_COUNT;
+    uint32_t packets = (len > PACKET_SIZE) ? ((len + PACKET_SIZE - 1) / PACKET_SIZE) : 1;
+    txn = TXN_IN;
+    txnEnd = now + (uint64_t)(len + packets * BUS_OVERHEAD_BYTES) * BUS_CYCLES_PER_BYTE;
+    preferOut = true;
+  } else if (out) {
+    txnBank = outBank(EP_OUT);
+    txn = TXN_OUT;
+    txnEnd = now + (uint64_t)(outQueue[outTail % OUT_QUEUE_PACKETS].len + BUS_OVERHEAD_BYTES) * BUS_CYCLES_PER_BYTE;
+    preferOut = false;
+  }
+}
+
+static void completeIn(void) {
+  uint8_t bank = txnBank;
+  // the device could have taken the bank back while the transaction ran
+  if (!inEnabled(EP_IN) || !(epStatus[EP_IN] & bankReady(bank))) {
+    return;
+  }
+  UsbDeviceDescBank* desc = epBank(EP_IN, bank);
+  uint32_t len = desc->PCKSIZE.bit.BYTE_COUNT;
+  const uint8_t* data = (const uint8_t*)(uintptr_t)desc->ADDR.reg;
+  if ((inHead - inTail) + len > IN_BUFFER_SIZE) {
+    fatal("the host's IN buffer is full, read it with sim_usb_read");
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    inBuffer[(inHead + i) % IN_BUFFER_SIZE] = data[i];
+  }
+  inHead += len;
+
+  usbStats.in_packets += (len > PACKET_SIZE) ? ((len + PACKET_SIZE - 1) / PACKET_SIZE) : 1;
+  usbStats.in_bytes += len;
+  if (!len || (desc->PCKSIZE.bit.AUTO_ZLP && !(len % PACKET_SIZE))) {
+    usbStats.in_zlps++;
+  }
+  usbStats.last_in = now;
+
+  epStatus[EP_IN] &= ~bankReady(bank);
+  epFlags[EP_IN] |= bankFlag(bank);
+  if (inDual(EP_IN)) {
+    epStatus[EP_IN] ^= USB_DEVICE_EPSTATUS_CURBK;
+  }
+}
+
+static void completeOut(void) {
+  uint8_t bank = txnBank;
+  if (!outEnabled(EP_OUT) || (epStatus[EP_OUT] & bankReady(bank))) {
+    return;
+  }
+  packet_t* packet = &outQueue[outTail % OUT_QUEUE_PACKETS];
+  outTail++;
+
+  UsbDeviceDescBank* desc = epBank(EP_OUT, bank);
+  uint32_t size = desc->PCKSIZE.bit.MULTI_PACKET_SIZE;
+  uint32_t count = desc->PCKSIZE.bit.BYTE_COUNT;
+  uint32_t space = (size > count) ? (size - count) : 0;
+  uint32_t len = packet->len;
+  if (len > space) {
+    usbStats.overruns++;
+    len = space;
+  }
+  memcpy((uint8_t*)(uintptr_t)desc->ADDR.reg + count, packet->data, len);
+  desc->PCKSIZE.bit.BYTE_COUNT = count + len;
+  usbStats.out_packets++;
+  usbStats.out_bytes += len;
+
+  // a short packet or filling the transfer ends it
+  if ((packet->len < PACKET_SIZE) || ((count + len) >= size)) {
+    epStatus[EP_OUT] |= bankReady(bank);
+    epFlags[EP_OUT] |= bankFlag(bank);
+    if (outDual(EP_OUT)) {
+      epStatus[EP_OUT] ^= USB_DEVICE_EPSTATUS_CURBK;
+    }
+  }
+}
+
+static void busProcess(void) {
+  if ((txn != TXN_NONE) && (txnEnd <= now)) {
+    if (txn == TXN_IN) {
+      completeIn();
+    } else {
+      completeOut();
+    }
+    txn = TXN_NONE;
+  }
+  if (txn == TXN_NONE) {
+    startTransaction();
+  }
+}
+
+static bool usbLevel(void) {
+  if (controlHead != controlTail) {
+    return true;
+  }
+  for (uint8_t n = 1; n < EP_COUNT; n++) {
+    if (epFlags[n] & epInten[n] & (USB_DEVICE_EPINTFLAG_TRCPT0 | USB_DEVICE_EPINTFLAG_TRCPT1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void busReset(void) {
+  for (uint8_t n = 0; n < EP_COUNT; n++) {
+    usbRegs.DEVICE.DeviceEndpoint[n].EPCFG.reg = 0;
+    epStatus[n] = 0;
+    epFlags[n] = 0;
+    epInten[n] = 0;
+  }
+  txn = TXN_NONE;
+}
+
+static void runControl(control_t* request) {
+  controlStalled = false;
+  switch (request->type) {
+    case CONTROL_RESET:
+      usbFold();
+      busReset();
+      usbPresent();
+      usb_cb_reset();
+      break;
+    case CONTROL_CONFIGURE:
+      if (!usb_cb_set_configuration(request->setup.wValue & 0xff)) {
+        controlStalled = true;
+      }
+      break;
+    case CONTROL_CLASS:
+      usb_setup = request->setup;
+      usb_cb_control_setup();
+      if (!controlStalled && !(usb_setup.bmRequestType & USB_REQTYPE_DIRECTION_MASK) && usb_setup.wLength) {
+        // data stage
+        memcpy(ep0_buf_out, request->data, usb_setup.wLength);
+        ep0OutLength = usb_setup.wLength;
+        usb_cb_control_out_completion();
+      }
+      break;
+  }
+}
+
+// the stack's USB_Handler, control requests then usb_cb_completion on every interrupt
+static void usbHandler(void) {
+  while (controlTail != controlHead) {
+    control_t request = controlQueue[controlTail % CONTROL_QUEUE];
+    controlTail++;
+    runControl(&request);
+  }
+  usb_cb_completion();
+}
+
+static void queueControl(const control_t* request) {
+  if ((uint8_t)(controlHead - controlTail) >= CONTROL_QUEUE) {
+    fatal("too many control requests queued");
+  }
+  controlQueue[controlHead % CONTROL_QUEUE] = *request;
+  controlHead++;
+  if (!sim_primask) {
+    service();
+  }
+}
+
+void sim_usb_bus_reset(void) {
+  control_t request = {.type = CONTROL_RESET};
+  queueControl(&request);
+}
+
+void sim_usb_configure(void) {
+  sim_usb_bus_reset();
+  control_t request = {.type = CONTROL_CONFIGURE, .setup = {.wValue = 1}};
+  queueControl(&request);
+}
+
+void sim_usb_set_line_coding(uint32_t baud_rate) {
+  CDC_LineEncoding coding = {baud_rate, 0, 0, 8};
+  control_t request = {
+    .type = CONTROL_CLASS,
+    .setup = {0x21, CDC_SET_LINE_ENCODING, 0, INTERFACE_CDC_CONTROL, sizeof(coding)},
+  };
+  memcpy(request.data, &coding, sizeof(coding));
+  queueControl(&request);
+}
+
+void sim_usb_set_control_line_state(uint8_t state) {
+  control_t request = {
+    .type = CONTROL_CLASS,
+    .setup = {0x21, CDC_SET_CONTROL_LINE_STATE, state, INTERFACE_CDC_CONTROL, 0},
+  };
+  queueControl(&request);
+}
+
+bool sim_usb_control_stalled(void) {
+  return controlStalled;
+}
+
+void sim_usb_send_packet(const void* data, uint8_t len) {
+  if (len > PACKET_SIZE) {
+    fatal("OUT packet larger than the endpoint");
+  }
+  if ((outHead - outTail) >= OUT_QUEUE_PACKETS) {
+    fatal("too many OUT packets queued");
+  }
+  packet_t* packet = &outQueue[outHead % OUT_QUEUE_PACKETS];
+  packet->len = len;
+  memcpy(packet->data, data, len);
+  outHead++;
+}
+
+void sim_usb_send(const void* data, uint32_t len) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  while (len) {
+    uint8_t packet = (len > PACKET_SIZE) ? PACKET_SIZE : len;
+    sim_usb_send_packet(bytes, packet);
+    bytes += packet;
+    len -= packet;
+  }
+}
+
+uint32_t sim_usb_out_pending(void) {
+  uint32_t bytes = 0;
+  for (uint32_t i = outTail; i != outHead; i++) {
+    bytes += outQueue[i % OUT_QUEUE_PACKETS].len;
+  }
+  return bytes;
+}
+
+uint32_t sim_usb_available(void) {
+  return inHead - inTail;
+}
+
+uint32_t sim_usb_read(void* buffer, uint32_t max_len) {
+  uint8_t* bytes = (uint8_t*)buffer;
+  uint32_t len = 0;
+  while ((len < max_len) && (inTail != inHead)) {
+    bytes[len++] = inBuffer[inTail % IN_BUFFER_SIZE];
+    inTail++;
+  }
+  return len;
+}
+
+void sim_usb_poll_in(bool enable) {
+  pollIn = enable;
+}
+
+const sim_usb_stats_t* sim_usb_stats(void) {
+  return &usbStats;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Timeline
+
+// apply register writes and everything due by now
+static void sync(void) {
+  scbFold();
+  nvicFold();
+  systickFold();
+  rtcFold();
+  usbFold();
+
+  systickProcess();
+  rtcProcess();
+  busProcess();
+
+  scbPresent();
+  nvicPresent();
+  systickPresent();
+  rtcPresent();
+  usbPresent();
+}
+
+static uint64_t nextEvent(void) {
+  uint64_t next = NEVER;
+  if (stRunning && (stZeroAt < next)) {
+    next = stZeroAt;
+  }
+  uint64_t rtc = rtcNextEvent();
+  if (rtc < next) {
+    next = rtc;
+  }
+  if ((txn != TXN_NONE) && (txnEnd < next)) {
+    next = txnEnd;
+  }
+  return next;
+}
+
+static bool excActive(int exc) {
+  switch (exc) {
+    case EXC_USB:
+      return (nvicEnabled & (1UL << USB_IRQn)) && (excPending[EXC_USB] || usbLevel());
+    case EXC_RTC:
+      return (nvicEnabled & (1UL << RTC_IRQn)) && (excPending[EXC_RTC] || rtcLevel());
+    default:
+      return excPending[exc];
+  }
+}
+
+// the exception that would be taken, -1 if none can preempt the current priority
+static int nextException(void) {
+  int best = -1;
+  for (int exc = 0; exc < EXC_COUNT; exc++) {
+    if (excActive(exc) && (excPriority[exc] < execPriority) && ((best < 0) || (excPriority[exc] < excPriority[best]))) {
+      best = exc;
+    }
+  }
+  return best;
+}
+
+static void take(int exc) {
+  uint8_t saved = execPriority;
+  setPending(exc, false);
+  execPriority = excPriority[exc];
+  handlerDepth++;
+  switch (exc) {
+    case EXC_USB:
+      usbHandler();
+      break;
+    case EXC_RTC:
+      if (RTC_Handler) {
+        RTC_Handler();
+      }
+      break;
+    case EXC_SYSTICK:
+      if (SysTick_Handler) {
+        SysTick_Handler();
+      }
+      break;
+    case EXC_PENDSV:
+      deferred_run();
+      break;
+  }
+  handlerDepth--;
+  execPriority = saved;
+}
+
+// take every interrupt that can preempt the current priority, handlers that enable interrupts are
+// preempted in turn
+static void service(void) {
+  while (!sim_primask) {
+    sync();
+    int exc = nextException();
+    if (exc < 0) {
+      return;
+    }
+    take(exc);
+  }
+}
+
+void sim_enable_irq(void) {
+  sim_primask = 0;
+  service();
+}
+
+// sleep until an interrupt that could preempt is pending, even with PRIMASK set
+void sim_wfi(void) {
+  if (handlerDepth) {
+    fatal("WFI from a handler");
+  }
+  while (true) {
+    sync();
+    if (nextException() >= 0) {
+      break;
+    }
+    uint64_t next = nextEvent();
+    if (next == NEVER) {
+      fatal("WFI with nothing left to wake it");
+    }
+    now = next;
+  }
+  if (!sim_primask) {
+    service();
+  }
+}
+
+void sim_advance_cycles(uint64_t cycles) {
+  uint64_t target = now + cycles;
+  while (true) {
+    sync();
+    if (!sim_primask) {
+      service();
+    }
+    uint64_t next = nextEvent();
+    if (next > target) {
+      break;
+    }
+    now = next;
+  }
+  now = target;
+  sync();
+  if (!sim_primask) {
+    service();
+  }
+}
+
+void sim_advance_us(uint32_t us) {
+  sim_advance_cycles((uint64_t)us * (F_CPU_SIM / 1000000));
+}
+
+uint64_t sim_cycles(void) {
+  return now;
+}
+
+uint64_t sim_micros(void) {
+  return now / (F_CPU_SIM / 1000000);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Reset
+
+void sim_system_reset(void) {
+  resetInfo.resets++;
+  resetInfo.erased = (sim_nvmctrl.CTRLA.reg == (NVMCTRL_CTRLA_CMD_ER | NVMCTRL_CTRLA_CMDEX_KEY));
+  resetInfo.erase_addr = resetInfo.erased ? sim_nvmctrl.ADDR.reg : 0;
+  sim_nvmctrl.CTRLA.reg = 0;
+  if (!sim_reset_target) {
+    fatal("reset");
+  }
+  sim_primask = 0;
+  handlerDepth = 0;
+  execPriority = THREAD_PRIORITY;
+  longjmp(*sim_reset_target, 1);
+}
+
+const sim_reset_info_t* sim_reset_info(void) {
+  return &resetInfo;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void sim_init(void) {
+  NVIC_SetPriority(USB_IRQn, 0);
+  NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+#ifdef TICKLESS_IDLE
+  initTicks();
+#else
+  // SysTick_Config
+  SysTick->LOAD = (SystemCoreClock / 1000) - 1;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+  NVIC_SetPriority(SysTick_IRQn, (1 << __NVIC_PRIO_BITS) - 2);
+#endif
+  NVIC_EnableIRQ(USB_IRQn);
+  sync();
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+// Simulated SAMD21 for running the core on the host, see samd.h for the registers.
+//
+// Time is virtual and counted in core clock cycles. Code takes no time, time only passes while the core
+// sleeps in WFI (until the next event) or when sim_advance_us() stands in for work the main loop does.
+// Interrupts run as nested calls at the points the core could take them: __enable_irq(), WFI and while time
+// passes, in NVIC priority order, so USB and the tick preempt the deferred work running from PendSV.
+// Busy waits on time that never sleep don't see it pass. delayMicroseconds() and prepareTickClock()
+// can't be used, nor delay() unless tickless, where it sleeps.
+//
+// The USB device controller runs the CDC endpoints from their registers and descriptors, as USB-CDC.c
+// sets them up. A simulated host sends OUT packets as the endpoint accepts them and polls IN, with each
+// transaction taking its time on a full-speed bus.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// start the tick as SystemStart does and attach USB, the host hasn't configured the device yet
+void sim_init(void);
+
+uint64_t sim_cycles(void);
+uint64_t sim_micros(void);
+// let time pass as if the main loop were busy, interrupts run if they are enabled
+void sim_advance_us(uint32_t us);
+void sim_advance_cycles(uint64_t cycles);
+
+// A reset, e.g. from the 1200 baud touch, jumps here if set, otherwise the simulation stops.
+// The core isn't restarted, anything run after it sees the state the reset left.
+extern jmp_buf* sim_reset_target;
+typedef struct {
+  uint32_t resets;
+  bool erased;           // the application was erased before the last reset
+  uint32_t erase_addr;
+} sim_reset_info_t;
+const sim_reset_info_t* sim_reset_info(void);
+
+// RTC count after a software reset, set close to 0xFFFFFFFF to test the overflow
+extern uint32_t sim_rtc_reset_count;
+
+// ---------------------------------------------------------------------------------------------------------
+// USB host, called from the main loop
+
+// bus reset, then SET_CONFIGURATION 1
+void sim_usb_configure(void);
+void sim_usb_bus_reset(void);
+void sim_usb_set_line_coding(uint32_t baud_rate);
+void sim_usb_set_control_line_state(uint8_t state);
+// true if the device stalled the last control request
+bool sim_usb_control_stalled(void);
+
+// queue data to send, split into 64 byte packets
+void sim_usb_send(const void* data, uint32_t len);
+// queue a single packet of up to 64 bytes, 0 for a zero length packet
+void sim_usb_send_packet(const void* data, uint8_t len);
+// bytes queued that the device hasn't received yet
+uint32_t sim_usb_out_pending(void);
+
+// bytes the host has received and not read
+uint32_t sim_usb_available(void);
+uint32_t sim_usb_read(void* buffer, uint32_t max_len);
+// stop the host polling IN, so the device's buffers fill as with a stalled terminal
+void sim_usb_poll_in(bool enable);
+
+typedef struct {
+  uint32_t in_packets;
+  uint32_t in_bytes;
+  uint32_t in_zlps;
+  uint32_t out_packets;
+  uint32_t out_bytes;
+  uint32_t overruns;  // OUT packets larger than the space the endpoint was given
+  uint64_t last_in;   // cycles when the last IN transaction completed
+} sim_usb_stats_t;
+const sim_usb_stats_t* sim_usb_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
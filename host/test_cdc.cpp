@@ -0,0 +1,219 @@
+// USBserial over the simulated USB device controller, from configuration to the 1200 baud reset.
+// Built for each transfer mode, see the Makefile.
+
+#include <string.h>
+#include <setjmp.h>
+#include "USBserial.h"
+#include "sim.h"
+#include "check.h"
+
+#define CYCLES_PER_US (F_CPU_SIM / 1000000)
+
+static void fill(char* data, uint32_t len, uint32_t seed) {
+  for (uint32_t i = 0; i < len; i++) {
+    data[i] = (char)((i * 7) + seed);
+  }
+}
+
+// advance until the host has received len bytes or timeout_us passes
+static bool hostWait(uint32_t len, uint32_t timeout_us) {
+  for (uint32_t waited = 0; sim_usb_available() < len; waited += 10) {
+    if (waited >= timeout_us) {
+      return false;
+    }
+    sim_advance_us(10);
+  }
+  return true;
+}
+
+static void testConfigure() {
+  sim_usb_configure();
+  sim_advance_us(1000);
+  CHECK(!sim_usb_control_stalled());
+  CHECK(!usbserial.isOpen());
+
+  sim_usb_set_line_coding(115200);
+  sim_usb_set_control_line_state(CDC_LINESTATE_DTR_MASK | CDC_LINESTATE_RTS_MASK);
+  sim_advance_us(100);
+  CHECK(!sim_usb_control_stalled());
+  CHECK(usbserial.isOpen());
+  CHECK_EQ(usbserial.baudrate(), 115200);
+  CHECK(!usbserial.available());
+}
+
+static void testReceive() {
+  static char sent[3000];
+  static char received[3000];
+  fill(sent, sizeof(sent), 1);
+  sim_usb_send(sent, sizeof(sent));
+
+  CHECK_EQ(usbserial.read_exact(received, sizeof(received), 1000), sizeof(received));
+  CHECK(!memcmp(sent, received, sizeof(sent)));
+  CHECK_EQ(sim_usb_out_pending(), 0);
+  CHECK_EQ(sim_usb_stats()->overruns, 0);
+
+  // nothing more arrives, so the wait ends at the timeout
+  uint64_t start = sim_micros();
+  CHECK_EQ(usbserial.read_exact(received, 1, 20), 0);
+  CHECK(sim_micros() - start >= 19000);
+}
+
+static void testTransmit() {
+  static char sent[16384];
+  static char received[16384];
+  fill(sent, sizeof(sent), 2);
+
+  uint64_t start = sim_cycles();
+  CHECK_EQ(usbserial.write_all(sent, sizeof(sent), 1000), sizeof(sent));
+  usbserial.flush();
+  CHECK(hostWait(sizeof(sent), 100000));
+  uint64_t cycles = sim_usb_stats()->last_in - start;
+  CHECK_EQ(sim_usb_read(received, sizeof(received)), sizeof(sent));
+  CHECK(!memcmp(sent, received, sizeof(sent)));
+
+  bench_result("cdc_tx_bytes_per_s", (double)sizeof(sent) * F_CPU_SIM / cycles, "bytes/s");
+}
+
+static void testEchoLatency() {
+  const int rounds = 20;
+  uint64_t total = 0;
+  for (int i = 0; i < rounds; i++) {
+    char c = 'a' + i;
+    char echo = 0;
+    uint64_t start = sim_cycles();
+    sim_usb_send(&c, 1);
+    CHECK_EQ(usbserial.read_exact(&c, 1, 100), 1);
+    usbserial.write(c);
+    CHECK(hostWait(1, 10000));
+    total += sim_usb_stats()->last_in - start;
+    CHECK_EQ(sim_usb_read(&echo, 1), 1);
+    CHECK_EQ(echo, 'a' + i);
+  }
+  bench_result("cdc_echo_latency_us", (double)total / rounds / CYCLES_PER_US, "us");
+}
+
+static void testBackpressure() {
+  static char sent[4096];
+  static char received[4096];
+  fill(sent, sizeof(sent), 3);
+
+  // the host stops reading, so writes stop once the buffer is full
+  sim_usb_poll_in(false);
+  uint64_t start = sim_micros();
+  uint16_t len = usbserial.write_all(sent, sizeof(sent), 50);
+  CHECK(len > 0);
+  CHECK(len <= USB_SERIAL_TX_BUFFER_LENGTH);
+  CHECK(sim_micros() - start >= 49000);
+  CHECK(usbserial.writeBufFull());
+  CHECK_EQ(sim_usb_available(), 0);
+
+  // and carry on in order once it does
+  sim_usb_poll_in(true);
+  CHECK_EQ(usbserial.write_all(sent + len, sizeof(sent) - len, 1000), sizeof(sent) - len);
+  usbserial.flush();
+  CHECK(hostWait(sizeof(sent), 100000));
+  CHECK_EQ(sim_usb_read(received, sizeof(received)), sizeof(sent));
+  CHECK(!memcmp(sent, received, sizeof(sent)));
+}
+
+static volatile uint8_t events = 0;
+static volatile uint64_t delimiterAt = 0;
+static volatile uint64_t idleAt = 0;
+
+static void onEvents(uint8_t new_events) {
+  if (new_events & USB_SERIAL_EVENT_DELIMITER) {
+    delimiterAt = sim_micros();
+  }
+  if (new_events & USB_SERIAL_EVENT_IDLE) {
+    idleAt = sim_micros();
+  }
+  events |= new_events;
+}
+
+// a main loop calling handleEvents() every 10us
+static void handleEventsFor(uint32_t us) {
+  for (uint32_t waited = 0; waited < us; waited += 10) {
+    sim_advance_us(10);
+    usbserial.handleEvents();
+  }
+}
+
+static void testReceiveEvents() {
+  char line[16];
+  usbserial.onReceive(onEvents, 0, '\n', 5);
+  uint64_t start = sim_micros();
+  sim_usb_send("hello\n", 6);
+  // the handler only runs from the main loop
+  sim_advance_us(1000);
+  CHECK_EQ(events, 0);
+  CHECK(usbserial.handleEvents());
+  CHECK(events & USB_SERIAL_EVENT_DELIMITER);
+  CHECK(!usbserial.handleEvents());
+
+  events = 0;
+  start = sim_micros();
+  sim_usb_send("again\n", 6);
+  handleEventsFor(1000);
+  CHECK(events & USB_SERIAL_EVENT_DELIMITER);
+  CHECK(!(events & USB_SERIAL_EVENT_IDLE));
+  CHECK(delimiterAt - start < 100);
+
+  handleEventsFor(10000);
+  CHECK(events & USB_SERIAL_EVENT_IDLE);
+  // 5ms of ticks after the packet arrived
+  CHECK(idleAt - delimiterAt >= 4000);
+  CHECK(idleAt - delimiterAt <= 6000);
+
+  CHECK_EQ(usbserial.read_until(line, sizeof(line), '\n', 10), 6);
+  CHECK(!memcmp(line, "hello\n", 6));
+  CHECK_EQ(usbserial.read_until(line, sizeof(line), '\n', 10), 6);
+  CHECK(!memcmp(line, "again\n", 6));
+  usbserial.onReceive(NULL);
+}
+
+static void testZeroLengthPacket() {
+  char c = 0;
+  sim_usb_send_packet(NULL, 0);
+  sim_usb_send("x", 1);
+  CHECK_EQ(usbserial.read_exact(&c, 1, 10), 1);
+  CHECK_EQ(c, 'x');
+  CHECK(!usbserial.available());
+}
+
+static void testSerialReset() {
+  jmp_buf target;
+  sim_reset_target = &target;
+
+  sim_usb_set_line_coding(1200);
+  sim_advance_us(1000);
+  CHECK_EQ(sim_reset_info()->resets, 0);
+
+  volatile uint64_t start = sim_micros();
+  if (setjmp(target) == 0) {
+    // closing the port at 1200 baud resets into the bootloader 250ms later
+    sim_usb_set_control_line_state(0);
+    sim_advance_us(300000);
+    CHECK(false);
+    return;
+  }
+  sim_reset_target = NULL;
+  CHECK_EQ(sim_reset_info()->resets, 1);
+  CHECK(sim_reset_info()->erased);
+  uint64_t delay = sim_micros() - start;
+  CHECK(delay >= 249000);
+  CHECK(delay <= 252000);
+}
+
+int main() {
+  sim_init();
+  testConfigure();
+  testReceive();
+  testTransmit();
+  testEchoLatency();
+  testBackpressure();
+  testReceiveEvents();
+  testZeroLengthPacket();
+  // the device doesn't come back from the reset, so this is last
+  testSerialReset();
+  return check_result("test_cdc");
+}
@@ -0,0 +1,111 @@
+// USBpackets over the simulated USB device controller, built with USB_SERIAL_PACKET_MODE
+
+#include <string.h>
+#include "USBpackets.h"
+#include "sim.h"
+#include "check.h"
+
+static bool hostWait(uint32_t len, uint32_t timeout_us) {
+  for (uint32_t waited = 0; sim_usb_available() < len; waited += 10) {
+    if (waited >= timeout_us) {
+      return false;
+    }
+    sim_advance_us(10);
+  }
+  return true;
+}
+
+static uint8_t* receiveWait(uint8_t* len, uint32_t timeout_us) {
+  for (uint32_t waited = 0; waited < timeout_us; waited += 10) {
+    uint8_t* packet = usbpackets.receive(len);
+    if (packet) {
+      return packet;
+    }
+    sim_advance_us(10);
+  }
+  return NULL;
+}
+
+int main() {
+  sim_init();
+  sim_usb_configure();
+  sim_usb_set_control_line_state(CDC_LINESTATE_DTR_MASK);
+  sim_advance_us(1000);
+  CHECK(usbpackets.isOpen());
+  // only the receive buffers armed on the OUT endpoint are taken
+  uint8_t idle = usbpackets.freePackets();
+  CHECK(idle < USB_PACKET_POOL_SIZE);
+  CHECK(idle >= USB_PACKET_POOL_SIZE - USB_PACKET_RX_LIMIT);
+
+  // send
+  uint8_t* packet = usbpackets.allocate();
+  CHECK(packet != NULL);
+  CHECK_EQ(usbpackets.freePackets(), idle - 1);
+  memcpy(packet, "hello", 5);
+  CHECK(usbpackets.submit(packet, 5));
+  // it is no longer the caller's to submit or release
+  CHECK(!usbpackets.submit(packet, 5));
+  usbpackets.release(packet);
+  CHECK(hostWait(5, 1000));
+  char text[64];
+  CHECK_EQ(sim_usb_read(text, sizeof(text)), 5);
+  CHECK(!memcmp(text, "hello", 5));
+  CHECK_EQ(usbpackets.freePackets(), idle);
+  CHECK(!usbpackets.submit((uint8_t*)text, 5));
+
+  // receive, more packets than the receive limit wait on the host
+  const uint8_t count = USB_PACKET_RX_LIMIT + 2;
+  for (uint8_t i = 0; i < count; i++) {
+    memset(text, 'A' + i, i + 1);
+    sim_usb_send_packet(text, i + 1);
+  }
+  sim_advance_us(2000);
+  CHECK(sim_usb_out_pending() > 0);
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t len = 0;
+    packet = receiveWait(&len, 1000);
+    CHECK(packet != NULL);
+    if (!packet) {
+      break;
+    }
+    CHECK_EQ(len, i + 1);
+    CHECK_EQ(packet[0], 'A' + i);
+    CHECK_EQ(packet[len - 1], 'A' + i);
+    usbpackets.release(packet);
+  }
+  sim_advance_us(1000);
+  CHECK(!usbpackets.available());
+  CHECK_EQ(sim_usb_out_pending(), 0);
+  CHECK_EQ(usbpackets.freePackets(), idle);
+
+  // echo by sending the received buffer straight back
+  uint64_t start = sim_cycles();
+  for (uint8_t i = 0; i < 32; i++) {
+    memset(text, i, sizeof(text));
+    sim_usb_send_packet(text, sizeof(text) - 1);
+  }
+  uint32_t echoed = 0;
+  while (echoed < 32) {
+    uint8_t len = 0;
+    packet = receiveWait(&len, 1000);
+    CHECK(packet != NULL);
+    if (!packet) {
+      break;
+    }
+    CHECK_EQ(packet[0], echoed);
+    CHECK(usbpackets.submit(packet, len));
+    echoed++;
+  }
+  CHECK(hostWait(32 * 63, 10000));
+  uint64_t cycles = sim_usb_stats()->last_in - start;
+  for (uint8_t i = 0; i < 32; i++) {
+    CHECK_EQ(sim_usb_read(text, 63), 63);
+    CHECK_EQ(text[0], i);
+    CHECK_EQ(text[62], i);
+  }
+  sim_advance_us(1000);
+  CHECK_EQ(usbpackets.freePackets(), idle);
+  bench_result("packets_echo_bytes_per_s", (double)(32 * 63) * F_CPU_SIM / cycles, "bytes/s");
+
+  return check_result("test_packets");
+}
@@ -0,0 +1,364 @@
+// RingBuffer and PacketRingBuffer checks, including randomized runs against a reference model
+
+#include <string.h>
+#include <deque>
+#include <vector>
+#include "RingBuffer.h"
+#include "PacketRingBuffer.h"
+#include "check.h"
+
+// xorshift32, fixed seeds so failures can be repeated
+static uint32_t rngState = 1;
+static uint32_t rnd(uint32_t n) {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return n ? (rngState % n) : 0;
+}
+
+// clearing after the consumer has read some of the data leaves the buffer empty and usable,
+// reads don't look like direct transfers still in flight
+template <uint16_t N, uint8_t flags> static void testClearAfterRead() {
+  RingBuffer<N, flags> buffer;
+  uint8_t out[16];
+  CHECK_EQ(buffer.store("0123456789", 10), 10);
+  CHECK_EQ(buffer.read(out, 5), 5);
+  buffer.clear();
+  CHECK_EQ(buffer.usedSpace(), 0);
+  CHECK_EQ(buffer.unsentSpace(), 0);
+  CHECK(buffer.isEmpty());
+
+  CHECK_EQ(buffer.store("abc", 3), 3);
+  CHECK_EQ(buffer.read_char(), 'a');
+  buffer.clear();
+  CHECK(buffer.isEmpty());
+
+  RingBufferSpan regions[2];
+  CHECK_EQ(buffer.store("abcdef", 6), 6);
+  CHECK_EQ(buffer.peek(regions), 6);
+  buffer.consume(2);
+  buffer.clear();
+  CHECK(buffer.isEmpty());
+
+  // data stored after the clear is sent whole
+  typename RingBuffer<N, flags>::len_t len;
+  CHECK_EQ(buffer.store("ABCDEFGH", 8), 8);
+  uint8_t* data = buffer.prepareDirectRead(&len, 8);
+  CHECK(len > 0);
+  CHECK(!memcmp(data, "ABCDEFGH", len));
+}
+
+// a transfer in flight when the buffer is cleared still completes, the rest is dropped after it
+template <uint16_t N, uint8_t flags> static void testClearInFlight() {
+  RingBuffer<N, flags> buffer;
+  typename RingBuffer<N, flags>::len_t len;
+  CHECK_EQ(buffer.store("0123456789", 10), 10);
+  buffer.prepareDirectRead(&len, 4);
+  CHECK_EQ(len, 4);
+  buffer.clear();
+  CHECK_EQ(buffer.unsentSpace(), 0);
+  buffer.completeDirectRead(len);
+  CHECK(buffer.isEmpty());
+}
+
+// in locked mode the head is only padded to realign when the last bytes are sent
+static void testAlignPadding() {
+  RingBuffer<16, BUFFER_USB_TX_ALIGN> buffer;
+  RingBuffer<16, BUFFER_USB_TX_ALIGN>::len_t len;
+  CHECK_EQ(buffer.store("0123456789", 10), 10);
+  // a limit below 4 with more data queued can't be padded
+  buffer.prepareDirectRead(&len, 2);
+  CHECK_EQ(len, 0);
+  CHECK_EQ(buffer.usedSpace(), 10);
+
+  uint8_t* data = buffer.prepareDirectRead(&len, 16);
+  CHECK_EQ(len, 8);
+  CHECK(!memcmp(data, "01234567", 8));
+  buffer.completeDirectRead(len);
+
+  data = buffer.prepareDirectRead(&len, 2);
+  CHECK_EQ(len, 2);
+  CHECK(!memcmp(data, "89", 2));
+  CHECK_EQ(buffer.usedSpace(), 4);
+  buffer.completeDirectRead(len);
+  CHECK(buffer.isEmpty());
+
+  // an empty buffer isn't padded
+  buffer.prepareDirectRead(&len, 16);
+  CHECK_EQ(len, 0);
+  CHECK(buffer.isEmpty());
+}
+
+template <uint16_t N, uint8_t flags> static void testClear() {
+  testClearAfterRead<N, flags>();
+  testClearInFlight<N, flags>();
+}
+
+// reserve() and prepareCopyRead() don't build for locked TX_ALIGN buffers, so the model only calls them
+// through this when they do
+template <bool enabled> struct Unpadded {
+  template <class ring_t> static uint16_t reserve(ring_t& buffer, RingBufferSpan regions[2]) {
+    return buffer.reserve(regions);
+  }
+  template <class ring_t> static uint16_t prepareCopyRead(ring_t& buffer, uint8_t* data, uint16_t limit) {
+    return buffer.prepareCopyRead(data, min(limit, (typename ring_t::len_t)~0));
+  }
+};
+template <> struct Unpadded<false> {
+  template <class ring_t> static uint16_t reserve(ring_t&, RingBufferSpan[2]) { return 0; }
+  template <class ring_t> static uint16_t prepareCopyRead(ring_t&, uint8_t*, uint16_t) { return 0; }
+};
+
+// A producer and a consumer take turns at random against a byte queue model.
+// The producer uses store, reserve/commit and direct writes. The consumer either reads, peeks and
+// clears, or sends with direct and copied reads of up to two transfers in flight.
+// Everything read or sent must come out in the order it was stored.
+template <uint16_t N, uint8_t flags> static void testModel(bool direct_read, uint32_t seed) {
+  typedef RingBuffer<N, flags> ring_t;
+  typedef typename ring_t::len_t len_t;
+  // the locked TX_ALIGN mode pads the head, so the used space can be more than the data
+  const bool padded = (flags & BUFFER_USB_TX_ALIGN) && !(flags & BUFFER_LOCK_FREE);
+  typedef Unpadded<!((flags & BUFFER_USB_TX_ALIGN) && !(flags & BUFFER_LOCK_FREE))> unpadded;
+  const len_t capacity = ((N & (N - 1)) == 0) ? N : N - 1;
+
+  struct transfer_t {
+    uint8_t* data;
+    std::vector<uint8_t> expected;
+  };
+
+  ring_t buffer;
+  std::deque<uint8_t> model;  // stored and not yet read or sent
+  std::deque<transfer_t> flight;
+  uint32_t inFlight = 0;  // including the padding of short transfers in locked TX_ALIGN mode
+  uint32_t dropped = 0;   // cleared behind transfers in flight, released with the last of them
+  uint8_t in[2 * N];
+  uint8_t out[2 * N];
+  static uint8_t copies[2][N];
+  uint8_t copyIdx = 0;
+  unsigned failures = check_failures;
+
+  rngState = seed;
+  for (uint32_t i = 0; (i < 20000) && (check_failures == failures); i++) {
+    uint32_t op = rnd(direct_read ? 8 : 10);
+    if (op < 4) {
+      // producer
+      len_t len = rnd(N + 4);
+      for (len_t j = 0; j < len; j++) {
+        in[j] = rnd(256);
+      }
+      len_t stored = 0;
+      uint32_t kind = rnd(4);
+      if (kind == 0) {
+        stored = buffer.store((const char*)in, len);
+        CHECK_EQ(stored, min(len, buffer.availableSpace() + stored));
+      } else if (kind == 1) {
+        stored = buffer.store(in[0]);
+      } else if ((kind == 2) && !padded) {
+        RingBufferSpan regions[2];
+        len_t space = unpadded::reserve(buffer, regions);
+        CHECK_EQ(space, buffer.availableSpace());
+        CHECK_EQ(regions[0].len + regions[1].len, space);
+        stored = min(len, space);
+        uint16_t first = min(stored, regions[0].len);
+        memcpy(regions[0].data, in, first);
+        memcpy(regions[1].data, in + first, stored - first);
+        buffer.commit(stored);
+      } else {
+        len_t space;
+        uint8_t* data = buffer.prepareDirectWrite(&space);
+        stored = min(len, space);
+        if ((flags & BUFFER_USB_RX_ALIGN) && stored) {
+          CHECK(!((uintptr_t)data & 0x3));
+        }
+        memcpy(data, in, stored);
+        buffer.completeDirectWrite(stored);
+      }
+      model.insert(model.end(), in, in + stored);
+    } else if (direct_read) {
+      // DMA consumer
+      if ((op < 6) && (flight.size() < 2)) {
+        len_t len;
+        uint8_t* data;
+        if (!padded && rnd(2)) {
+          data = copies[copyIdx];
+          // two copies in flight at most, so they alternate between two buffers
+          len = unpadded::prepareCopyRead(buffer, data, rnd(N) + 1);
+          copyIdx ^= (len != 0);
+        } else {
+          data = buffer.prepareDirectRead(&len, rnd(N) + 1);
+        }
+        if (!len) {
+          continue;
+        }
+        CHECK(len <= model.size());
+        if ((flags & BUFFER_USB_TX_ALIGN) && (data != copies[0]) && (data != copies[1])) {
+          CHECK(!((uintptr_t)data & 0x3));
+        }
+        transfer_t transfer = {data, std::vector<uint8_t>(model.begin(), model.begin() + len)};
+        CHECK(!memcmp(data, transfer.expected.data(), len));
+        model.erase(model.begin(), model.begin() + len);
+        inFlight += padded ? ((len + 3) & ~3) : len;
+        flight.push_back(transfer);
+      } else if ((op < 7) && !flight.empty()) {
+        transfer_t& transfer = flight.front();
+        // the data mustn't have been overwritten while the transfer ran
+        CHECK(!memcmp(transfer.data, transfer.expected.data(), transfer.expected.size()));
+        buffer.completeDirectRead(transfer.expected.size());
+        inFlight -= padded ? ((transfer.expected.size() + 3) & ~3) : transfer.expected.size();
+        flight.pop_front();
+        if (flight.empty()) {
+          dropped = 0;
+        }
+      } else if ((op == 7) && !rnd(16)) {
+        buffer.clear();
+        if (!flight.empty() && (flags & BUFFER_LOCK_FREE)) {
+          dropped += model.size();
+        }
+        model.clear();
+        CHECK_EQ(buffer.unsentSpace(), 0);
+      }
+    } else {
+      // plain consumer
+      len_t len = rnd(N + 4);
+      len_t got = 0;
+      if (op < 6) {
+        got = buffer.read(out, len);
+        CHECK_EQ(got, min(len, model.size()));
+      } else if (op < 7) {
+        if (!model.empty()) {
+          out[0] = buffer.read_char();
+          got = 1;
+        }
+      } else if (op < 9) {
+        RingBufferSpan regions[2];
+        len_t used = buffer.peek(regions);
+        CHECK_EQ(used, model.size());
+        CHECK_EQ(regions[0].len + regions[1].len, used);
+        got = min(len, used);
+        uint16_t first = min(got, regions[0].len);
+        memcpy(out, regions[0].data, first);
+        memcpy(out + first, regions[1].data, got - first);
+        buffer.consume(got);
+      } else if (!rnd(8)) {
+        buffer.clear();
+        model.clear();
+      }
+      CHECK(std::equal(out, out + got, model.begin()));
+      model.erase(model.begin(), model.begin() + got);
+    }
+
+    CHECK_EQ(buffer.usedSpace(), model.size() + inFlight + dropped);
+    CHECK_EQ(buffer.usedSpace() + buffer.availableSpace(), capacity);
+    CHECK_EQ(buffer.isEmpty(), buffer.usedSpace() == 0);
+    CHECK_EQ(buffer.isFull(), buffer.availableSpace() == 0);
+  }
+  if (check_failures != failures) {
+    fprintf(stderr, "  in testModel<%u, 0x%x>(%d, %u)\n", N, flags, direct_read, seed);
+  }
+}
+
+// The USB interrupt fills whole packet slots, up to two armed at once, the main loop reads,
+// peeks and clears
+template <uint16_t N, uint8_t P> static void testPacketModel(uint32_t seed) {
+  typedef PacketRingBuffer<N, P> ring_t;
+  typedef typename ring_t::len_t len_t;
+  ring_t buffer;
+  std::deque<uint8_t> model;
+  std::deque<uint8_t*> armed;
+  uint8_t out[2 * N];
+  unsigned failures = check_failures;
+
+  rngState = seed;
+  for (uint32_t i = 0; (i < 20000) && (check_failures == failures); i++) {
+    uint32_t op = rnd(10);
+    if ((op < 2) && (armed.size() < 2)) {
+      len_t len;
+      uint8_t* slot = buffer.prepareDirectWrite(&len);
+      if (slot) {
+        CHECK_EQ(len, P);
+        CHECK(!((uintptr_t)slot & 0x3));
+        armed.push_back(slot);
+      }
+    } else if ((op < 5) && !armed.empty()) {
+      // short and empty packets as well as full ones
+      uint8_t len = rnd(3) ? rnd(P + 1) : P;
+      for (uint8_t j = 0; j < len; j++) {
+        armed.front()[j] = rnd(256);
+      }
+      model.insert(model.end(), armed.front(), armed.front() + len);
+      buffer.completeDirectWrite(len);
+      armed.pop_front();
+    } else {
+      len_t len = rnd(N + 4);
+      len_t got = 0;
+      if (op < 7) {
+        got = buffer.read(out, len);
+        CHECK_EQ(got, min(len, model.size()));
+      } else if (op < 8) {
+        if (!buffer.isEmpty()) {
+          out[0] = buffer.read_char();
+          got = 1;
+        }
+      } else if (op < 9) {
+        // only the next two packets are peeked
+        RingBufferSpan regions[2];
+        len_t peeked = buffer.peek(regions);
+        CHECK(peeked <= model.size());
+        CHECK_EQ(peeked == 0, model.empty());
+        got = min(len, peeked);
+        uint16_t first = min(got, regions[0].len);
+        memcpy(out, regions[0].data, first);
+        memcpy(out + first, regions[1].data, got - first);
+        buffer.consume(got);
+      } else if (!rnd(8)) {
+        buffer.clear();
+        model.clear();
+      }
+      CHECK(std::equal(out, out + got, model.begin()));
+      model.erase(model.begin(), model.begin() + got);
+    }
+
+    CHECK_EQ(buffer.usedSpace(), model.size());
+    CHECK_EQ(buffer.isEmpty(), model.empty());
+  }
+  if (check_failures != failures) {
+    fprintf(stderr, "  in testPacketModel<%u, %u>(%u)\n", N, P, seed);
+  }
+}
+
+template <uint16_t N, uint8_t flags> static void testModels() {
+  for (uint32_t seed = 1; seed <= 4; seed++) {
+    testModel<N, flags>(false, seed);
+    testModel<N, flags>(true, seed);
+  }
+}
+
+int main() {
+  testClear<16, 0>();
+  testClear<16, BUFFER_LOCK_FREE>();
+  testClear<16, BUFFER_USB_TX_ALIGN>();
+  testClear<16, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE>();
+  testClear<15, 0>();
+  testClear<15, BUFFER_LOCK_FREE>();
+  testClear<300, BUFFER_LOCK_FREE>();
+  testAlignPadding();
+
+  testModels<16, 0>();
+  testModels<16, BUFFER_LOCK_FREE>();
+  testModels<16, BUFFER_USB_RX_ALIGN>();
+  testModels<16, BUFFER_USB_TX_ALIGN>();
+  testModels<16, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE>();
+  testModels<64, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE>();
+  testModels<128, BUFFER_USB_RX_ALIGN | BUFFER_LOCK_FREE>();
+  testModels<127, 0>();
+  testModels<127, BUFFER_LOCK_FREE>();
+  testModels<256, 0>();
+  testModels<300, BUFFER_LOCK_FREE>();
+  testModels<300, BUFFER_USB_TX_ALIGN>();
+  for (uint32_t seed = 1; seed <= 4; seed++) {
+    testPacketModel<128, 64>(seed);
+    testPacketModel<256, 64>(seed);
+    testPacketModel<64, 8>(seed);
+  }
+  return check_result("test_ringbuffer");
+}
@@ -0,0 +1,189 @@
+// Lock-free ring buffers with the producer and the consumer on two threads, as the main loop and the USB
+// interrupt share them. Both sides pick their methods at random and the consumer checks every byte
+// arrives in order. Locked buffers rely on masking interrupts on a single core, so aren't run here.
+// The two sides only overlap on a host with more than one core, on one they mostly take turns.
+
+#include <string.h>
+#include <thread>
+#include "RingBuffer.h"
+#include "check.h"
+
+// bytes sent through each buffer in each mode
+#define STRESS_BYTES 2000000
+
+// xorshift32, each thread has its own
+struct Random {
+  uint32_t state;
+  explicit Random(uint32_t seed) : state(seed) {}
+  uint32_t operator()(uint32_t n) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return n ? (state % n) : 0;
+  }
+};
+
+// the stream sent, doesn't repeat with any buffer size
+static inline uint8_t streamByte(uint32_t i) {
+  return (uint8_t)(i + (i >> 8) + (i >> 16));
+}
+
+template <uint16_t N, uint8_t flags> static void producer(RingBuffer<N, flags>* buffer, uint32_t seed) {
+  typedef typename RingBuffer<N, flags>::len_t len_t;
+  Random rnd(seed);
+  uint8_t chunk[N];
+  uint32_t sent = 0;
+  while (sent < STRESS_BYTES) {
+    len_t len = min((uint32_t)(rnd(N) + 1), (uint32_t)(STRESS_BYTES - sent));
+    for (len_t i = 0; i < len; i++) {
+      chunk[i] = streamByte(sent + i);
+    }
+    len_t stored;
+    switch (rnd(4)) {
+    case 0:
+      stored = buffer->store((const char*)chunk, len);
+      break;
+    case 1:
+      stored = buffer->store(chunk[0]);
+      break;
+    case 2: {
+      RingBufferSpan regions[2];
+      buffer->reserve(regions);
+      stored = min(len, (len_t)(regions[0].len + regions[1].len));
+      uint16_t first = min(stored, regions[0].len);
+      memcpy(regions[0].data, chunk, first);
+      memcpy(regions[1].data, chunk + first, stored - first);
+      buffer->commit(stored);
+      break;
+    }
+    default: {
+      len_t space;
+      uint8_t* data = buffer->prepareDirectWrite(&space);
+      stored = min(len, space);
+      memcpy(data, chunk, stored);
+      buffer->completeDirectWrite(stored);
+      break;
+    }
+    }
+    sent += stored;
+    if (!stored) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+// reads, peeks and single bytes as the main loop takes received data
+template <uint16_t N, uint8_t flags> static uint32_t readConsumer(RingBuffer<N, flags>* buffer, uint32_t seed) {
+  typedef typename RingBuffer<N, flags>::len_t len_t;
+  Random rnd(seed);
+  uint8_t out[N];
+  uint32_t received = 0;
+  uint32_t errors = 0;
+  while (received < STRESS_BYTES) {
+    len_t len = rnd(N) + 1;
+    len_t got = 0;
+    switch (rnd(3)) {
+    case 0:
+      got = buffer->read(out, len);
+      break;
+    case 1:
+      if (!buffer->isEmpty()) {
+        out[0] = buffer->read_char();
+        got = 1;
+      }
+      break;
+    default: {
+      RingBufferSpan regions[2];
+      got = min(len, buffer->peek(regions));
+      uint16_t first = min(got, regions[0].len);
+      memcpy(out, regions[0].data, first);
+      memcpy(out + first, regions[1].data, got - first);
+      buffer->consume(got);
+      break;
+    }
+    }
+    for (len_t i = 0; i < got; i++) {
+      errors += (out[i] != streamByte(received + i));
+    }
+    received += got;
+    if (!got) {
+      std::this_thread::yield();
+    }
+  }
+  return errors;
+}
+
+// direct and copied transfers as the USB interrupt sends, up to two in flight.
+// The data of a transfer must still be intact when it completes.
+template <uint16_t N, uint8_t flags> static uint32_t sendConsumer(RingBuffer<N, flags>* buffer, uint32_t seed) {
+  typedef typename RingBuffer<N, flags>::len_t len_t;
+  Random rnd(seed);
+  static uint8_t copies[2][N];
+  uint8_t copyIdx = 0;
+  struct {
+    uint8_t* data;
+    len_t len;
+    uint32_t start;
+  } flight[2];
+  uint8_t inFlight = 0;
+  uint32_t sent = 0;
+  uint32_t completed = 0;
+  uint32_t errors = 0;
+  while (completed < STRESS_BYTES) {
+    if ((inFlight < 2) && rnd(2)) {
+      len_t len;
+      uint8_t* data;
+      if (rnd(2)) {
+        data = copies[copyIdx];
+        len = buffer->prepareCopyRead(data, rnd(N) + 1);
+        copyIdx ^= (len != 0);
+      } else {
+        data = buffer->prepareDirectRead(&len, rnd(N) + 1);
+      }
+      if (len) {
+        flight[inFlight].data = data;
+        flight[inFlight].len = len;
+        flight[inFlight].start = sent;
+        inFlight++;
+        sent += len;
+      } else {
+        std::this_thread::yield();
+      }
+    } else if (inFlight) {
+      for (len_t i = 0; i < flight[0].len; i++) {
+        errors += (flight[0].data[i] != streamByte(flight[0].start + i));
+      }
+      buffer->completeDirectRead(flight[0].len);
+      completed += flight[0].len;
+      flight[0] = flight[1];
+      inFlight--;
+    }
+  }
+  return errors;
+}
+
+template <uint16_t N, uint8_t flags> static void testStress(bool send, uint32_t seed) {
+  static RingBuffer<N, flags> buffer;
+  std::thread thread(producer<N, flags>, &buffer, seed);
+  uint32_t errors = send ? sendConsumer<N, flags>(&buffer, seed + 1) : readConsumer<N, flags>(&buffer, seed + 1);
+  thread.join();
+  CHECK_EQ(errors, 0);
+  CHECK(buffer.isEmpty());
+  if (errors) {
+    fprintf(stderr, "  in testStress<%u, 0x%x>(%d, %u)\n", N, flags, send, seed);
+  }
+}
+
+template <uint16_t N, uint8_t flags> static void testModes() {
+  testStress<N, flags>(false, 1);
+  testStress<N, flags>(true, 2);
+}
+
+int main() {
+  testModes<16, BUFFER_LOCK_FREE>();
+  testModes<64, BUFFER_USB_TX_ALIGN | BUFFER_LOCK_FREE>();
+  testModes<128, BUFFER_USB_RX_ALIGN | BUFFER_LOCK_FREE>();
+  testModes<127, BUFFER_LOCK_FREE>();
+  testModes<300, BUFFER_LOCK_FREE>();
+  return check_result("test_spsc");
+}
@@ -0,0 +1,134 @@
+// Software timers against the simulated tick, random one-shot and periodic timers started, restarted
+// and cancelled while time passes. Built with SysTick and tickless, see the Makefile.
+
+#include <vector>
+#include "generic.h"
+#include "Timer.h"
+#include "sim.h"
+#include "check.h"
+
+#define TIMER_COUNT 48
+
+// xorshift32, fixed seed so failures can be repeated
+static uint32_t rngState = 1;
+static uint32_t rnd(uint32_t n) {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return n ? (rngState % n) : 0;
+}
+
+struct test_timer_t {
+  soft_timer_t timer;
+  bool started;
+  uint32_t delay;
+  uint32_t period;
+  uint32_t startedAt;
+  std::vector<uint32_t> fired;  // millis() of each callback
+};
+static test_timer_t timers[TIMER_COUNT];
+
+static void onTimer(void* arg) {
+  test_timer_t* timer = (test_timer_t*)arg;
+  CHECK(timer->started);
+  timer->fired.push_back(millis());
+}
+
+// A timer runs in the ms its delay ends, then every period from when it was due.
+// Nothing else keeps the core busy, so each callback runs in the very ms it is due in.
+static void verify(test_timer_t* timer, uint32_t now) {
+  if (!timer->started) {
+    CHECK(timer->fired.empty());
+    return;
+  }
+  uint32_t due = timer->startedAt + (timer->delay ? timer->delay : 1);
+  size_t expected = 0;
+  if ((int32_t)(now - due) >= 0) {
+    expected = timer->period ? ((now - due) / timer->period + 1) : 1;
+  }
+  CHECK_EQ(timer->fired.size(), expected);
+  for (size_t i = 0; i < timer->fired.size(); i++) {
+    CHECK_EQ(timer->fired[i], due + i * timer->period);
+  }
+}
+
+static void start(test_timer_t* timer, uint32_t delay, uint32_t period) {
+  verify(timer, millis());
+  timer->started = true;
+  timer->delay = delay;
+  timer->period = period;
+  timer->startedAt = millis();
+  timer->fired.clear();
+  timer_start(&timer->timer, delay, period);
+  CHECK(timer_running(&timer->timer));
+}
+
+static void cancel(test_timer_t* timer) {
+  verify(timer, millis());
+  timer->started = false;
+  timer->fired.clear();
+  timer_cancel(&timer->timer);
+  CHECK(!timer_running(&timer->timer));
+}
+
+// delays spread over every level of the wheel
+static uint32_t randomDelay() {
+  switch (rnd(4)) {
+  case 0:
+    return rnd(64);
+  case 1:
+    return 64 + rnd(4096 - 64);
+  case 2:
+    return 4096 + rnd(20000);
+  default:
+    return rnd(8);
+  }
+}
+
+int main() {
+  sim_init();
+  for (uint8_t i = 0; i < TIMER_COUNT; i++) {
+    timer_init(&timers[i].timer, onTimer, &timers[i]);
+  }
+
+  // start, restart and cancel at random while time passes
+  for (uint32_t step = 0; step < 4000; step++) {
+    test_timer_t* timer = &timers[rnd(TIMER_COUNT)];
+    uint32_t op = rnd(8);
+    if (op < 4) {
+      start(timer, randomDelay(), 0);
+    } else if (op < 5) {
+      start(timer, randomDelay(), 1 + rnd(300));
+    } else if (op < 6) {
+      cancel(timer);
+    }
+    sim_advance_us(rnd(3000));
+  }
+
+  // let everything still running fire, the periodic timers a few times more
+  sim_advance_us(30000000);
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < TIMER_COUNT; i++) {
+    verify(&timers[i], now);
+    CHECK_EQ(timer_running(&timers[i].timer), timers[i].started && timers[i].period);
+    cancel(&timers[i]);
+  }
+
+#ifdef TICKLESS_IDLE
+  // a timer beyond the reach of the wheel waits in its last level until due.
+  // With SysTick that is 4.6 hours of ticks to simulate, the wheel is the same either way
+  test_timer_t* far = &timers[0];
+  uint32_t wheel_ms = 1UL << 24;
+  start(far, wheel_ms + 1234, 0);
+  for (uint32_t s = 0; s < wheel_ms / 1000; s++) {
+    sim_advance_us(1000000);
+  }
+  CHECK(far->fired.empty());
+  sim_advance_us(2000000);
+  verify(far, millis());
+  CHECK_EQ(far->fired.size(), 1);
+  CHECK(!timer_running(&far->timer));
+#endif
+
+  return check_result("test_timer");
+}
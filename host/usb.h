@@ -0,0 +1,152 @@
+#pragma once
+
+// Host stand-in for the USB stack in thirdparty/usb, the parts USB-CDC.c uses.
+// The endpoint functions are implemented by the simulated device controller in sim.c.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_ALIGN __attribute__((__aligned__(4)))
+
+typedef uint32_t usb_size;
+
+#define USB_EP0_SIZE 64
+
+// standard descriptors
+#define USB_DTYPE_Device        0x01
+#define USB_DTYPE_Configuration 0x02
+#define USB_DTYPE_String        0x03
+#define USB_DTYPE_Interface     0x04
+#define USB_DTYPE_Endpoint      0x05
+#define USB_DTYPE_CSInterface   0x24
+
+#define USB_CSCP_NoDeviceSubclass 0x00
+#define USB_CSCP_NoDeviceProtocol 0x00
+
+#define USB_CONFIG_ATTR_BUSPOWERED 0x80
+#define USB_CONFIG_POWER_MA(mA)    ((mA) / 2)
+
+#define USB_EP_TYPE_CONTROL     0x00
+#define USB_EP_TYPE_ISOCHRONOUS 0x01
+#define USB_EP_TYPE_BULK        0x02
+#define USB_EP_TYPE_INTERRUPT   0x03
+
+#define ENDPOINT_ATTR_NO_SYNC (0 << 2)
+#define ENDPOINT_USAGE_DATA   (0 << 4)
+
+#define USB_LANGUAGE_EN_US 0x0409
+#define USB_STRING_LEN(c)  (2 + ((c) * 2))
+
+// setup packets
+#define USB_REQTYPE_DIRECTION_MASK 0x80
+#define USB_REQTYPE_TYPE_MASK      0x60
+#define USB_REQTYPE_RECIPIENT_MASK 0x1F
+#define USB_REQTYPE_STANDARD       (0 << 5)
+#define USB_REQTYPE_CLASS          (1 << 5)
+#define USB_RECIPIENT_DEVICE       0
+#define USB_RECIPIENT_INTERFACE    1
+
+typedef struct {
+  uint8_t bmRequestType;
+  uint8_t bRequest;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+} __attribute__((packed)) USB_SetupPacket;
+
+typedef struct {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t bcdUSB;
+  uint8_t bDeviceClass;
+  uint8_t bDeviceSubClass;
+  uint8_t bDeviceProtocol;
+  uint8_t bMaxPacketSize0;
+  uint16_t idVendor;
+  uint16_t idProduct;
+  uint16_t bcdDevice;
+  uint8_t iManufacturer;
+  uint8_t iProduct;
+  uint8_t iSerialNumber;
+  uint8_t bNumConfigurations;
+} __attribute__((packed)) USB_DeviceDescriptor;
+
+typedef struct {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t wTotalLength;
+  uint8_t bNumInterfaces;
+  uint8_t bConfigurationValue;
+  uint8_t iConfiguration;
+  uint8_t bmAttributes;
+  uint8_t bMaxPower;
+} __attribute__((packed)) USB_ConfigurationDescriptor;
+
+typedef struct {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bInterfaceNumber;
+  uint8_t bAlternateSetting;
+  uint8_t bNumEndpoints;
+  uint8_t bInterfaceClass;
+  uint8_t bInterfaceSubClass;
+  uint8_t bInterfaceProtocol;
+  uint8_t iInterface;
+} __attribute__((packed)) USB_InterfaceDescriptor;
+
+typedef struct {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bEndpointAddress;
+  uint8_t bmAttributes;
+  uint16_t wMaxPacketSize;
+  uint8_t bInterval;
+} __attribute__((packed)) USB_EndpointDescriptor;
+
+typedef struct {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t bString[];
+} __attribute__((packed)) USB_StringDescriptor;
+
+extern USB_SetupPacket usb_setup;
+extern uint8_t ep0_buf_in[USB_EP0_SIZE];
+extern uint8_t ep0_buf_out[USB_EP0_SIZE];
+
+void usb_init(void);
+void usb_attach(void);
+void usb_detach(void);
+
+void usb_ep0_out(void);
+void usb_ep0_in(uint8_t size);
+void usb_ep0_stall(void);
+
+void usb_enable_ep(uint8_t ep, uint8_t type, usb_size bufsize);
+void usb_disable_ep(uint8_t ep);
+void usb_ep_start_out(uint8_t ep, uint8_t* data, usb_size len);
+void usb_ep_start_in(uint8_t ep, const uint8_t* data, usb_size size, bool zlp);
+bool usb_ep_empty(uint8_t ep);
+bool usb_ep_ready(uint8_t ep);
+bool usb_ep_pending(uint8_t ep);
+void usb_ep_handled(uint8_t ep);
+usb_size usb_ep_out_length(uint8_t ep);
+
+void* usb_string_to_descriptor(char* str);
+
+// implemented by the device, USB-CDC.c
+uint16_t usb_cb_get_descriptor(uint8_t type, uint8_t index, const uint8_t** descriptor_ptr);
+void usb_cb_reset(void);
+bool usb_cb_set_configuration(uint8_t config);
+void usb_cb_control_setup(void);
+void usb_cb_control_in_completion(void);
+void usb_cb_control_out_completion(void);
+void usb_cb_completion(void);
+bool usb_cb_set_interface(uint16_t interface, uint16_t new_altsetting);
+
+#ifdef __cplusplus
+}
+#endif